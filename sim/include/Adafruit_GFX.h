@@ -0,0 +1,22 @@
+// Host stand-in for Adafruit_GFX. The simulation runs without a display, nothing is drawn.
+#pragma once
+#include <Arduino.h>
+
+class Adafruit_GFX : public Print {
+ public:
+  Adafruit_GFX(int16_t w, int16_t h) : w_(w), h_(h) {}
+  size_t write(uint8_t) override { return 1; }
+  void setTextColor(uint16_t) {}
+  void setTextColor(uint16_t, uint16_t) {}
+  void setTextSize(uint8_t) {}
+  void setCursor(int16_t, int16_t) {}
+  void cp437(bool) {}
+  void fillRect(int16_t, int16_t, int16_t, int16_t, uint16_t) {}
+  void fillCircle(int16_t, int16_t, int16_t, uint16_t) {}
+  int16_t width() { return w_; }
+  int16_t height() { return h_; }
+
+ private:
+  int16_t w_;
+  int16_t h_;
+};
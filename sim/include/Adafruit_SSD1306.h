@@ -0,0 +1,34 @@
+// Host stand-in for Adafruit_SSD1306: begin() fails, so the sketch runs as it does without a
+// display connected.
+#pragma once
+#include <Adafruit_GFX.h>
+#include <Wire.h>
+
+#define SSD1306_BLACK 0
+#define SSD1306_WHITE 1
+#define SSD1306_INVERSE 2
+#define BLACK SSD1306_BLACK
+#define WHITE SSD1306_WHITE
+#define SSD1306_SWITCHCAPVCC 0x02
+#define SSD1306_COLUMNADDR 0x21
+#define SSD1306_PAGEADDR 0x22
+#define SSD1306_SETCONTRAST 0x81
+#define SSD1306_DISPLAYOFF 0xAE
+#define SSD1306_DISPLAYON 0xAF
+
+class Adafruit_SSD1306 : public Adafruit_GFX {
+ public:
+  Adafruit_SSD1306(uint8_t w, uint8_t h, TwoWire *, int8_t = -1, uint32_t = 400000UL, uint32_t = 100000UL)
+    : Adafruit_GFX(w, h) {
+    memset(buffer_, 0, sizeof(buffer_));
+  }
+  bool begin(uint8_t = SSD1306_SWITCHCAPVCC, uint8_t = 0, bool = true, bool = true) { return false; }
+  void display() {}
+  void clearDisplay() { memset(buffer_, 0, sizeof(buffer_)); }
+  void dim(bool) {}
+  void ssd1306_command(uint8_t) {}
+  uint8_t *getBuffer() { return buffer_; }
+
+ private:
+  uint8_t buffer_[128 * 32 / 8];
+};
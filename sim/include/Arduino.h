@@ -0,0 +1,147 @@
+// Host stand-in for the Arduino core, just enough to run the sketch in the simulation.
+// Time only moves when the simulation advances sim_micros. The pins are mapped on the port
+// registers of <avr/io.h> like on the nano: D0 ... D7 on port D, D8 ... D13 on port B and
+// A0 ... A5 on port C.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef unsigned int word;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+
+#define constrain(x, low, high) ((x) < (low) ? (low) : ((x) > (high) ? (high) : (x)))
+
+inline unsigned long sim_micros = 0;
+
+inline unsigned long micros(void) { return sim_micros; }
+inline unsigned long millis(void) { return sim_micros / 1000; }
+inline void delay(unsigned long ms) { sim_micros += ms * 1000; }
+inline void delayMicroseconds(unsigned int us) { sim_micros += us; }
+
+inline volatile uint8_t *simPinRegister(uint8_t pin, bool input) {
+  if (pin < 8) return input ? &PIND : &PORTD;
+  if (pin < 14) return input ? &PINB : &PORTB;
+  return input ? &PINC : &PORTC;
+}
+
+inline uint8_t simPinBit(uint8_t pin) {
+  if (pin < 8) return pin;
+  if (pin < 14) return pin - 8;
+  return pin - 14;
+}
+
+inline void pinMode(uint8_t, uint8_t) {}
+
+inline void digitalWrite(uint8_t pin, uint8_t value) {
+  volatile uint8_t *port = simPinRegister(pin, false);
+  if (value == LOW) {
+    *port &= ~(1 << simPinBit(pin));
+  } else {
+    *port |= 1 << simPinBit(pin);
+  }
+}
+
+inline int digitalRead(uint8_t pin) {
+  if (pin >= A6) return HIGH; // A6 and A7 are analog only.
+  return (*simPinRegister(pin, true) >> simPinBit(pin)) & 1;
+}
+
+inline void analogWrite(uint8_t pin, int value) {
+  // Pins 9 and 10 are Timer1 on the nano, the core sets their compare registers.
+  if (pin == 9) OCR1A = value;
+  if (pin == 10) OCR1B = value;
+}
+
+inline int analogRead(uint8_t) { return ADC; }
+
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : -1))
+inline void attachInterrupt(uint8_t, void (*)(void), int) {}
+inline void noInterrupts(void) {}
+inline void interrupts(void) {}
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(PSTR(s)))
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  size_t write(const char *s) { return print(s); }
+  size_t write(const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) write(data[i]);
+    return length;
+  }
+  size_t print(const char *s) {
+    size_t n = 0;
+    while (*s) n += write((uint8_t) *s++);
+    return n;
+  }
+  size_t print(const __FlashStringHelper *s) { return print((const char *) s); }
+  size_t print(char c) { return write((uint8_t) c); }
+  size_t print(unsigned long value, int base = 10) {
+    char digits[33];
+    int n = 0;
+    do {
+      byte digit = value % base;
+      digits[n++] = (digit < 10) ? '0' + digit : 'A' + digit - 10;
+      value /= base;
+    } while (value > 0);
+    size_t written = 0;
+    while (n > 0) written += write((uint8_t) digits[--n]);
+    return written;
+  }
+  size_t print(long value, int base = 10) {
+    if ((value < 0) and (base == 10)) return print('-') + print((unsigned long) -value, base);
+    return print((unsigned long) value, base);
+  }
+  size_t print(int value, int base = 10) { return print((long) value, base); }
+  size_t print(unsigned int value, int base = 10) { return print((unsigned long) value, base); }
+  size_t print(unsigned char value, int base = 10) { return print((unsigned long) value, base); }
+  size_t println(void) { return print("\r\n"); }
+  template <typename T> size_t println(T value) { return print(value) + println(); }
+  template <typename T> size_t println(T value, int base) { return print(value, base) + println(); }
+};
+
+class HardwareSerial : public Print {
+ public:
+  bool echo = false;       // Copy the output to stderr.
+  std::deque<uint8_t> rx;  // Bytes waiting to be read by the sketch.
+  void begin(unsigned long) {}
+  size_t write(uint8_t c) override {
+    if (echo) fputc(c, stderr);
+    return 1;
+  }
+  using Print::write;
+  int available(void) { return (int) rx.size(); }
+  int read(void) {
+    if (rx.empty()) return -1;
+    int c = rx.front();
+    rx.pop_front();
+    return c;
+  }
+};
+inline HardwareSerial Serial;
@@ -0,0 +1,12 @@
+// Host stand-in for the Arduino EEPROM library.
+#pragma once
+#include <Arduino.h>
+#include <avr/eeprom.h>
+
+struct EEPROMClass {
+  uint8_t read(int address) { return sim_eeprom.data[address & E2END]; }
+  void write(int address, uint8_t value) { sim_eeprom.data[address & E2END] = value; }
+  void update(int address, uint8_t value) { write(address, value); }
+  uint16_t length() { return E2END + 1; }
+};
+inline EEPROMClass EEPROM;
@@ -0,0 +1,16 @@
+// Host stand-in for the OneButton library: the simulation does not press the encoder button.
+#pragma once
+#include <Arduino.h>
+
+typedef void (*callbackFunction)(void);
+
+class OneButton {
+ public:
+  OneButton() {}
+  OneButton(int, bool = true, bool = true) {}
+  void attachClick(callbackFunction) {}
+  void attachDoubleClick(callbackFunction) {}
+  void attachLongPressStart(callbackFunction) {}
+  void tick() {}
+  void tick(bool) {}
+};
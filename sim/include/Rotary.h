@@ -0,0 +1,13 @@
+// Host stand-in for the Rotary library: the simulation does not turn the encoder.
+#pragma once
+#include <Arduino.h>
+
+#define DIR_NONE 0x00
+#define DIR_CW   0x10
+#define DIR_CCW  0x20
+
+class Rotary {
+ public:
+  Rotary(char, char) {}
+  unsigned char process() { return DIR_NONE; }
+};
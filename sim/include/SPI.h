@@ -0,0 +1,2 @@
+// Host stand-in for the SPI library, not used by the sketch.
+#pragma once
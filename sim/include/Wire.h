@@ -0,0 +1,14 @@
+// Host stand-in for the Wire library: it only counts the bytes which would go over I2C.
+#pragma once
+#include <Arduino.h>
+
+class TwoWire : public Print {
+ public:
+  unsigned long bytes_sent = 0;
+  void begin() {}
+  void setClock(uint32_t) {}
+  void beginTransmission(uint8_t) { bytes_sent++; } // The address byte.
+  uint8_t endTransmission(bool = true) { return 0; }
+  size_t write(uint8_t) override { bytes_sent++; return 1; }
+};
+inline TwoWire Wire;
@@ -0,0 +1,16 @@
+// Host stand-in for <avr/eeprom.h>, on the EEPROM array of <avr/io.h>.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <avr/io.h>
+
+inline uint8_t eeprom_read_byte(const uint8_t *address) {
+  return sim_eeprom.data[(uintptr_t) address & E2END];
+}
+
+inline void eeprom_read_block(void *destination, const void *source, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    ((uint8_t *) destination)[i] = eeprom_read_byte((const uint8_t *) source + i);
+  }
+}
@@ -0,0 +1,6 @@
+// Host stand-in for <avr/interrupt.h>: an ISR is a plain function, called by the simulation.
+#pragma once
+
+#define ISR(vector) extern "C" void vector(void)
+inline void cli(void) {}
+inline void sei(void) {}
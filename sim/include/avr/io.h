@@ -0,0 +1,69 @@
+// Host stand-in for <avr/io.h>: the ATmega328 registers used by the sketch are plain variables,
+// so the simulation can read the PWM compare values and the switches, and set the input pins.
+#pragma once
+#include <stdint.h>
+
+#define SIM_REG8(name, value) inline volatile uint8_t name = value;
+#define SIM_REG16(name) inline volatile uint16_t name = 0;
+
+SIM_REG8(TCCR1A, 0) SIM_REG8(TCCR1B, 0) SIM_REG16(ICR1) SIM_REG16(OCR1A) SIM_REG16(OCR1B)
+SIM_REG8(TCCR2A, 0) SIM_REG8(TCCR2B, 0) SIM_REG8(TCNT2, 0) SIM_REG8(OCR2A, 0) SIM_REG8(TIMSK2, 0)
+SIM_REG8(ADMUX, 0) SIM_REG8(ADCSRA, 0) SIM_REG8(ADCSRB, 0) SIM_REG16(ADC)
+SIM_REG8(PCICR, 0) SIM_REG8(PCMSK0, 0) SIM_REG8(PCMSK1, 0)
+// The inputs have pullups: nothing pressed, no bypass and no debug jumper.
+SIM_REG8(PORTB, 0) SIM_REG8(DDRB, 0) SIM_REG8(PINB, 0xFF)
+SIM_REG8(PORTC, 0) SIM_REG8(DDRC, 0) SIM_REG8(PINC, 0xFF)
+SIM_REG8(PORTD, 0) SIM_REG8(DDRD, 0) SIM_REG8(PIND, 0xFF)
+SIM_REG16(EEAR) SIM_REG8(EEDR, 0)
+
+#define E2END 0x3FF
+
+// The EEPROM, erased (0xFF) at the start. Setting EERE or EEPE in EECR reads or writes the
+// byte at EEAR at once, a write is never busy. Setting EERIE calls the simulation's EEPROM
+// ready interrupt until it clears EERIE again, so queued writes are done right away.
+struct SimEeprom {
+  uint8_t data[E2END + 1];
+  SimEeprom() {
+    for (int i = 0; i <= E2END; i++) data[i] = 0xFF;
+  }
+};
+inline SimEeprom sim_eeprom;
+inline void (*sim_eeprom_interrupt)(void) = 0;
+
+struct SimEecr {
+  uint8_t value = 0;
+  operator uint8_t() const { return value; }
+  SimEecr &operator=(uint8_t bits) { value = bits; access(); return *this; }
+  SimEecr &operator|=(uint8_t bits) {
+    value |= bits;
+    access();
+    if (bits & (1 << 3)) interrupt(); // EERIE
+    return *this;
+  }
+  SimEecr &operator&=(uint8_t bits) { value &= bits; return *this; }
+  void access() {
+    if (value & (1 << 0)) EEDR = sim_eeprom.data[EEAR & E2END]; // EERE
+    if (value & (1 << 1)) sim_eeprom.data[EEAR & E2END] = EEDR; // EEPE
+    value &= ~((1 << 0) | (1 << 1) | (1 << 2));
+  }
+  void interrupt() {
+    static bool running = false; // The interrupt sets bits in EECR itself.
+    if (running or (sim_eeprom_interrupt == 0)) return;
+    running = true;
+    while (value & (1 << 3)) sim_eeprom_interrupt();
+    running = false;
+  }
+};
+inline SimEecr EECR;
+
+enum {
+  WGM10 = 0, WGM11 = 1, COM1B1 = 5, COM1A1 = 7, CS10 = 0, WGM12 = 3, WGM13 = 4,
+  WGM21 = 1, CS20 = 0, CS21 = 1, CS22 = 2, OCIE2A = 1,
+  REFS0 = 6, MUX0 = 0, ADEN = 7, ADSC = 6, ADATE = 5, ADIE = 3, ADPS0 = 0, ADPS1 = 1, ADPS2 = 2,
+  PCIE0 = 0, PCIE1 = 1, PCINT0 = 0, PCINT3 = 3, PCINT9 = 1,
+  EERE = 0, EEPE = 1, EEMPE = 2, EERIE = 3,
+  PB0 = 0, PB3 = 3, PINB0 = 0, PINB1 = 1, PINB2 = 2, PINB3 = 3, PINC1 = 1
+};
+
+#define F_CPU 16000000UL
+#define _BV(b) (1 << (b))
@@ -0,0 +1,13 @@
+// Host stand-in for <avr/pgmspace.h>: flash and RAM are the same on the host.
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(a) (*(const uint8_t *) (a))
+#define pgm_read_word(a) (*(const uint16_t *) (a))
+#define pgm_read_dword(a) (*(const uint32_t *) (a))
+#define pgm_read_ptr(a) (*(void * const *) (a))
+#define memcpy_P memcpy
+#define strlen_P strlen
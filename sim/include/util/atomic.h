@@ -0,0 +1,6 @@
+// Host stand-in for <util/atomic.h>: the simulation runs the interrupts in between, never inside.
+#pragma once
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+#define ATOMIC_BLOCK(type) for (int sim_atomic = 1; sim_atomic; sim_atomic = 0)
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Static RAM use of the Time-Warp-O-Matic sketch per subsystem.
+#
+# Reads the symbols of the sketch as built for the nano and adds up the variables in .data and
+# .bss by the subsystem their name belongs to. Tables in PROGMEM are in flash and not counted.
+# The 512 byte display buffer is allocated by Adafruit_SSD1306::begin() on the heap, so it is
+# listed separately and taken from what is left for the stack.
+#
+# Usage: ram_report.sh elf [nm]
+#   elf  the .elf of the sketch, e.g. from: arduino-cli compile -b arduino:avr:nano --output-dir build Time-Warp-O-Matic
+#   nm   the nm to read it with (default avr-nm)
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 elf [nm]" >&2
+  exit 1
+fi
+ELF=$1
+NM=${2:-avr-nm}
+RAM_SIZE=2048
+DISPLAY_BUFFER=512
+
+"$NM" -S -C -t d "$ELF" | awk -v ram_size=$RAM_SIZE -v display_buffer=$DISPLAY_BUFFER '
+function subsystem(name) {
+  if (name ~ /^(effect_state|effect|old_effect|shown_counter|count_direction|param_page|select_mode|no_dry_signal|old_no_dry_signal|settings_options|loopb|effect_status)$/) return "effect settings"
+  if (name ~ /^(engine_|output_duty|effect_duty|effect_routing|transition_|routing_state|tempo_|prng_state|lfo|psycho)/) return "control engine and LFO"
+  if (name ~ /^sweep_/) return "sweep engine"
+  if (name ~ /^pattern_/) return "pattern engine"
+  if (name ~ /^(cv_|envelope|duck_)/) return "CV and envelope input"
+  if (name ~ /^tap_/) return "tap tempo"
+  if (name ~ /^(input_|reading|rotary|button|last_detent|bypass|pcint0_pins|PCINT|led_ticks|toggleLed13)/) return "encoder, pedal and bypass"
+  if (name ~ /^(display|dirty_column|page_checksum|pages_forced|text_buffer|shown_|warp|next_warp|last_activity|user_activity|screen_saver|splash|delay_variable)/) return "display and screen saver"
+  if (name ~ /^(eeprom_|saved_settings|settings_slot|writeTimer|writeToEeprom|writeCalibration)/) return "settings and EEPROM"
+  if (name ~ /^(menu_|calibrat|self_?test|ui_mode)/) return "menu, calibration and self test"
+  if (name ~ /^(task_|profile)/) return "scheduler and profiler"
+  if (name ~ /^(remote_|midi_)/) return "remote control and MIDI"
+  if (name ~ /^(Serial|TwoWire|Wire|twi_|SPI|timer0_|__|rx_buffer|tx_buffer)/) return "Arduino core and libraries"
+  return "other"
+}
+# Lines with a size: value size type name.
+NF >= 4 && $3 ~ /^[bBdD]$/ {
+  name = $4
+  for (i = 5; i <= NF; i++) name = name " " $i
+  group = subsystem(name)
+  bytes[group] += $2
+  total += $2
+}
+END {
+  for (group in bytes) printf "%6d  %s\n", bytes[group], group | "sort -rn"
+  close("sort -rn")
+  printf "------\n%6d  static RAM (.data and .bss)\n", total
+  printf "%6d  display buffer (heap)\n", display_buffer
+  printf "%6d  left for the stack of %d\n", ram_size - total - display_buffer, ram_size
+}'
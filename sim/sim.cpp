@@ -0,0 +1,281 @@
+// Host simulation of the Time-Warp-O-Matic firmware.
+//
+// The sketch is compiled unchanged against the host stand-ins in include/, which replace the
+// Arduino core, the AVR registers and the libraries. The simulation advances the time, calls
+// the interrupt service routines the way the nano would and runs loop() in between. Per effect
+// it writes a trace of the delay times and the CD4066 switches to a CSV file and reports how
+// long a control tick took on the host, how far the delay times jumped per tick and how often
+// the routing changed, so LFO shapes, transitions and timing can be compared between builds.
+//
+// Before the effects it checks that the settings and a preset are read back as they were saved,
+// after them that the decelerator is heard on its way back.
+//
+// Usage: twom_sim [-e effect] [-t ms] [-p] [-b bpm] [-c cv] [-n envelope] [-o directory] [-v]
+//   -e  only simulate this effect number (default: all effects)
+//   -t  simulated time per effect in ms (default 5000)
+//   -p  hold the pedal down during the middle half of the run
+//   -b  tap the pedal 4 times at this tempo at the start of the run
+//   -c  level on the CV input, 0 ... 1023 (default 0)
+//   -n  level on the envelope input, 0 ... 1023 (default 0)
+//   -o  directory for the CSV files (default: the current directory)
+//   -v  copy the serial output of the sketch to stderr
+
+#include <chrono>
+#include <string>
+
+#include "Arduino.h"
+#include "../src/Time-Warp-O-Matic.ino"
+
+#define SIM_LOOPS_PER_TICK 10 // loop() runs this many times per control tick, evenly spread.
+
+struct SimOptions {
+  int effect = -1;
+  unsigned long run_ms = 5000;
+  bool pedal_hold = false;
+  unsigned int bpm = 0;
+  unsigned int cv = 0;
+  unsigned int envelope = 0;
+  std::string directory = ".";
+};
+
+struct SimStats {
+  unsigned long ticks = 0;
+  double total_ns = 0;
+  double max_ns = 0;
+  unsigned int duty1_min = 0xFFFF;
+  unsigned int duty1_max = 0;
+  unsigned int duty2_min = 0xFFFF;
+  unsigned int duty2_max = 0;
+  unsigned int max_step = 0; // Largest change of a delay time in one tick (Q8.8).
+  unsigned int routing_changes = 0;
+};
+
+void simSetPedal(bool pressed) {
+  // We use a pullup, so when low it is pressed.
+  byte pins = pressed ? (PINB & ~(1 << PINB0)) : (PINB | (1 << PINB0));
+  if (pins == PINB) return;
+  PINB = pins;
+  PCINT0_vect();
+}
+
+void simInterrupts(const SimOptions &options) {
+  // The interrupts which are due at every control tick.
+  #if defined(CV_INPUT) or defined(ENVELOPE_INPUT)
+    // The conversion which has just finished is of the channel selected now.
+    ADC = ((ADMUX & 0x07) == ((CV1 - A0) & 0x07)) ? options.cv : options.envelope;
+    ADC_vect();
+  #endif
+  TIMER2_COMPA_vect();
+}
+
+double simTick(const SimOptions &options) {
+  // One control tick: the interrupts, then loop() as often as it would run in the mean time.
+  // Returns how long the interrupts took on the host in ns.
+  auto start = std::chrono::steady_clock::now();
+  simInterrupts(options);
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  for (int i = 0; i < SIM_LOOPS_PER_TICK; i++) {
+    loop();
+    sim_micros += 1000000UL / CONTROL_RATE_HZ / SIM_LOOPS_PER_TICK;
+  }
+  return ns;
+}
+
+bool simPedal(const SimOptions &options, unsigned long t) {
+  // The level of the pedal t ms after the start of the run.
+  if (options.pedal_hold and (t >= options.run_ms / 4) and (t < 3 * options.run_ms / 4)) return true;
+  if (options.bpm > 0) {
+    unsigned long beat = 60000UL / options.bpm;
+    if ((t / beat < 4) and (t % beat < 50)) return true; // 50 ms taps.
+  }
+  return false;
+}
+
+void simEffectFileName(int fx, char *name, size_t size) {
+  // The effect's name with only letters and digits, e.g. "03_Echo1.csv".
+  const char *p = (const char *) EFFECT_PTR(fx, name);
+  int n = snprintf(name, size, "%02d_", fx);
+  for (; *p and (n < (int) size - 5); p++) {
+    if (((*p >= 'a') and (*p <= 'z')) or ((*p >= 'A') and (*p <= 'Z')) or ((*p >= '0') and (*p <= '9'))) {
+      name[n++] = *p;
+    }
+  }
+  snprintf(name + n, size - n, ".csv");
+}
+
+bool simEffect(int fx, const SimOptions &options, SimStats *stats) {
+  char name[64];
+  simEffectFileName(fx, name, sizeof(name));
+  std::string path = options.directory + "/" + name;
+  FILE *csv = fopen(path.c_str(), "w");
+  if (csv == NULL) {
+    fprintf(stderr, "Can not write %s\n", path.c_str());
+    return false;
+  }
+  fprintf(csv, "t_ms,duty1,duty2,ocr1b,ocr1a,swa,swb,swc,swd\n");
+  effect = fx;
+  select_mode = true;
+  unsigned int last_duty1 = output_duty1;
+  unsigned int last_duty2 = output_duty2;
+  byte last_routing = routing_state;
+  for (unsigned long t = 0; t < options.run_ms; t++) {
+    simSetPedal(simPedal(options, t));
+    double ns = simTick(options);
+    stats->ticks++;
+    stats->total_ns += ns;
+    if (ns > stats->max_ns) stats->max_ns = ns;
+    unsigned int duty1 = output_duty1;
+    unsigned int duty2 = output_duty2;
+    if (duty1 < stats->duty1_min) stats->duty1_min = duty1;
+    if (duty1 > stats->duty1_max) stats->duty1_max = duty1;
+    if (duty2 < stats->duty2_min) stats->duty2_min = duty2;
+    if (duty2 > stats->duty2_max) stats->duty2_max = duty2;
+    // The first tick of the run is the switch to the effect (into its transition).
+    if (t > 0) {
+      unsigned int step1 = abs((int) duty1 - (int) last_duty1);
+      unsigned int step2 = abs((int) duty2 - (int) last_duty2);
+      if (step1 > stats->max_step) stats->max_step = step1;
+      if (step2 > stats->max_step) stats->max_step = step2;
+    }
+    if (routing_state != last_routing) stats->routing_changes++;
+    last_duty1 = duty1;
+    last_duty2 = duty2;
+    last_routing = routing_state;
+    fprintf(csv, "%lu,%u,%u,%u,%u,%d,%d,%d,%d\n", t, duty1, duty2, (unsigned int) OCR1B, (unsigned int) OCR1A,
+            (PORTD >> SWA) & 1, (PORTD >> SWB) & 1, (PORTD >> SWC) & 1, (PORTD >> SWD) & 1);
+  }
+  fclose(csv);
+  return true;
+}
+
+void simClobberSettings(void) {
+  // Other settings than the ones just saved, all in range.
+  effect = (effect + 1) % NR_OF_EFFECTS;
+  settings_options ^= OPTION_STAGE;
+  for (int i = 0; i < NR_OF_EFFECTS; i++) {
+    effect_state[i].counter = EFFECT_WORD(i, counter_min);
+    effect_state[i].depth = 0;
+  }
+}
+
+bool simSettingsRoundTrip(void) {
+  // Save the settings and a preset, change the settings and read them back. The host has 32-bit
+  // ints like the RP2040, so this also checks that the record layout does not depend on them.
+  // A recall has to leave the options as they are.
+  SettingsRecord before, expected, found;
+  fillRecord(&before, 0);
+  effect = 1;
+  effect_state[1].counter = EFFECT_WORD(1, counter_max);
+  effect_state[1].depth = DEPTH_MAX / 2;
+  fillRecord(&expected, 0);
+  bool ok = saveSettings() and (saveSettings() == false); // Unchanged settings are not written again.
+  simClobberSettings();
+  readSettingsFromEeprom();
+  fillRecord(&found, 0);
+  if ((ok == false) or (memcmp(&expected, &found, RECORD_SIZE) != 0)) {
+    fprintf(stderr, "The settings were not read back as they were saved.\n");
+    return false;
+  }
+  storePreset(0);
+  simClobberSettings();
+  byte options = settings_options;
+  ok = recallPreset(0) and (settings_options == options);
+  settings_options = expected.options;
+  fillRecord(&found, 0);
+  if ((ok == false) or (memcmp(&expected, &found, RECORD_SIZE) != 0)) {
+    fprintf(stderr, "Preset 1 was not recalled as it was stored.\n");
+    return false;
+  }
+  applyRecord(&before, true);
+  saveSettings();
+  writeToEeprom = false;
+  return true;
+}
+
+bool simSweepReturn(void) {
+  // Hold the pedal until the decelerator has come to a halt and is muted, then release it: the
+  // sweep back has to be heard, so the wet signal has to be on all the way.
+  SimOptions idle;
+  unsigned int old_counter = effect_state[DECELERATOR].counter;
+  effect_state[DECELERATOR].counter = EFFECT_WORD(DECELERATOR, counter_min);
+  effect = DECELERATOR;
+  select_mode = true;
+  simSetPedal(true);
+  for (int t = 0; (t < 60000) and (sweep_state != SWEEP_END); t++) {
+    simTick(idle);
+  }
+  bool ok = (sweep_state == SWEEP_END);
+  simSetPedal(false);
+  int back_ticks = 0;
+  do {
+    simTick(idle);
+    if (sweep_state != SWEEP_BACK) break;
+    back_ticks++;
+    if (((PORTD >> SWB) & 1) == 0) ok = false;
+  } while (back_ticks < 60000);
+  effect_state[DECELERATOR].counter = old_counter;
+  if ((ok == false) or (back_ticks == 0)) {
+    fprintf(stderr, "The decelerator does not sweep back with the wet signal on.\n");
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  SimOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    bool has_value = (i + 1 < argc);
+    if ((option == "-e") and has_value) {
+      options.effect = atoi(argv[++i]);
+    } else if ((option == "-t") and has_value) {
+      options.run_ms = strtoul(argv[++i], NULL, 10);
+    } else if (option == "-p") {
+      options.pedal_hold = true;
+    } else if ((option == "-b") and has_value) {
+      options.bpm = atoi(argv[++i]);
+    } else if ((option == "-c") and has_value) {
+      options.cv = atoi(argv[++i]) & 0x3FF;
+    } else if ((option == "-n") and has_value) {
+      options.envelope = atoi(argv[++i]) & 0x3FF;
+    } else if ((option == "-o") and has_value) {
+      options.directory = argv[++i];
+    } else if (option == "-v") {
+      Serial.echo = true;
+    } else {
+      fprintf(stderr, "Usage: %s [-e effect] [-t ms] [-p] [-b bpm] [-c cv] [-n envelope] [-o directory] [-v]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (options.effect >= NR_OF_EFFECTS) {
+    fprintf(stderr, "There are %d effects (0 ... %d).\n", NR_OF_EFFECTS, NR_OF_EFFECTS - 1);
+    return 1;
+  }
+
+  sim_eeprom_interrupt = EE_READY_vect;
+  setup();
+  if (simSettingsRoundTrip() == false) return 1;
+  // Let the splash screen pass, as on the pedal the first effect is heard while it is drawn.
+  SimOptions idle = options;
+  idle.pedal_hold = false;
+  idle.bpm = 0;
+  for (int t = 0; t < 5000; t++) {
+    simTick(idle);
+  }
+
+  printf("%-3s %-16s %8s %8s %8s %13s %13s %8s %8s\n", "fx", "name", "ticks", "avg ns", "max ns",
+         "duty1", "duty2", "max step", "routing");
+  for (int fx = 0; fx < NR_OF_EFFECTS; fx++) {
+    if ((options.effect >= 0) and (fx != options.effect)) continue;
+    SimStats stats;
+    if (simEffect(fx, options, &stats) == false) return 1;
+    printf("%-3d %-16s %8lu %8.0f %8.0f %6u-%-6u %6u-%-6u %8u %8u\n", fx, (const char *) EFFECT_PTR(fx, name),
+           stats.ticks, stats.total_ns / stats.ticks, stats.max_ns, stats.duty1_min, stats.duty1_max,
+           stats.duty2_min, stats.duty2_max, stats.max_step, stats.routing_changes);
+  }
+  if (simSweepReturn() == false) return 1;
+  for (byte i = 0; i < NR_OF_TASKS; i++) {
+    if (task_overruns[i] > 0) printf("task %d overran its budget %u times\n", i, (unsigned int) task_overruns[i]);
+  }
+  return 0;
+}
@@ -3,6 +3,90 @@
  This code is based on the V1.0 firmware for the Time Manipulator guitar pedal
  more info at www.electrosmash.com but has undergone quite a few alterations.
 
+ v0.3 (work in progress)
+ - the display is no longer pushed as a whole with every update. Only the pages (8 pixel rows)
+   that were drawn into and whose contents really changed are sent over I2C.
+ - the effects are run by a control rate engine called from a 1 kHz Timer2 interrupt. It sets the
+   CD4066 switches and the PWM outputs, so the chorus, psycho, decelerator and wow modulation no
+   longer depend on how long loop() is busy with the display and the buttons.
+ - the chorus, fast chorus, psycho and wow effects use table driven LFO's (sine, triangle and
+   random walk waveforms in flash) in stead of linear ramps, random() and floating point math.
+ - the PT2399 delay times are set with 10 bit phase correct PWM on Timer1 (HIRES_PWM) in stead of
+   8 bit analogWrite(), so the chorus, psycho, wow and decelerator sweeps move in finer steps.
+ - added a delay time calibration mode (long press). Per board a PWM duty to ms curve is stored
+   in EEPROM, the display shows the delay times in ms and the two boards are matched.
+ - the CV input (A7) is now used. It is sampled by the ADC in the background and can, per effect,
+   shorten the delay time or set the speed or depth of the LFO.
+ - tap tempo for the delay and echo effects. The pedal presses (or an external clock) are timed
+   in a pin change interrupt and the delay time is set to the (subdivided) beat.
+ - no more String objects: text is formatted into a static buffer without sprintf and the effect
+   names, status texts and version are kept in flash (PROGMEM).
+ - the effects are described in one table in flash (name, routing, dry option, counter range,
+   display and tick function). The engine calls the effect's tick function directly and the
+   user interface reads the table in stead of switching on the effect.
+ - the CD4066 switches are set with a single write of PORTD, so a routing change no longer passes
+   through in between states.
+ - the settings are saved as CRC checked records which rotate through the EEPROM (wear leveling)
+   and there are 4 presets, recalled and stored with the long press menu. Calibration moved
+   into that menu as well. The records have the same layout in a DEBUG build.
+ - EEPROM writes are queued and done in the background by the EEPROM ready interrupt, and the
+   LED blink is timed by the control timer, so saving no longer stalls loop() for 100 ms.
+ - fast boot: the effect is restored and running within milliseconds after power on. The splash
+   screen (SPLASH_SCREEN) is drawn step by step while the effect runs and a missing display no
+   longer stops the boot.
+ - changing the effect no longer chirps and pops: the engine passes only the dry signal while the
+   delay times glide to the new effect in 32 ms, then it switches on the new routing.
+ - loop() runs a small cooperative scheduler with prioritized periodic tasks (control, input, UI
+   at 30 Hz, screen saver, persistence), each with a time budget. The debug, bypass, menu and
+   calibration modes no longer block in while loops and StensTimer is no longer needed.
+ - the encoder and push button interrupts only queue compact events in a lock free ring buffer,
+   the input task handles them, so fast turns no longer lose steps.
+ - encoder acceleration: a fast turn moves a setting up to 16 times as far per detent. The
+   settings are 16 bit with a range and step per effect, the delay times are set in quarter PWM
+   steps. The settings and presets of earlier v0.3 builds are not taken over.
+ - parameter pages: the single press steps through the time or speed, the LFO depth and the CV
+   routing of the effect. They are stored with the settings and presets and used by the engine.
+ - a self test in the long press menu checks the PWM outputs, the CD4066 switches, the pedal
+   and (when wired) the CV input, and reports on the display and as a remote control frame on
+   the serial port, so bench tests no longer need a DEBUG build.
+ - PROFILE: compile time switch which times the control tick (and its jitter), the interrupts,
+   the display flush, the EEPROM save and the tasks, and reports min/avg/max and a histogram
+   over the serial port.
+ - remote control over the serial port: binary commands for the effect, its parameters and the
+   presets, or MIDI Program Change and CC at 31250 baud (MIDI_REMOTE). They are parsed a few
+   bytes at a time by the input task.
+ - fixed point helpers (Q8.8, Q0.16) for the LFO, CV and speed computations and a xorshift
+   random generator, which gives every period of the wow random walk its own speed.
+ - added the Duck echo effect: an echo which is switched off while you play and comes back in
+   the gaps. It needs a rectified copy of the input on A6 (ENVELOPE_INPUT), the ADC then
+   alternates between the CV and the envelope input and follows the level in its interrupt.
+ - bypass is a debounced state in stead of a loop which stopped everything else, it is drawn
+   once and with a delayed bypass (Bypass 2s in the long press menu) the effect keeps running
+   for 2 seconds before the bypass.
+ - display power manager: the display is dimmed with SSD1306 commands when idle and, with
+   Stage on (long press menu), switched off after 10 seconds so the I2C bus stays quiet while
+   you play. The screen saver's time warp is drawn frame by frame by the UI task, a few pages
+   per frame, in stead of 44 full screen pushes with delay() which stalled the pedal.
+ - host simulation (sim/): the sketch builds unchanged as a native program against stand-ins
+   for the Arduino core, the AVR registers and the libraries. It runs every effect, writes the
+   delay times and the switches per control tick to CSV and reports the tick time, the largest
+   step of the delay times and the routing changes.
+ - added the Pattern effect: a pattern engine which steps through rhythmic sequences (in flash),
+   setting the delay time of each PT2399 and the taps per step. The steps are timed by the
+   control tick at the tempo set with the encoder or tapped on the pedal.
+ - sweep engine: the decelerator is one of the sweeps run by sweepTick(), which follows a 32 bit
+   position along a linear, exponential or S shaped curve in flash. Added the Accelerator, which
+   speeds the signal up while the pedal is held. Both sweep back when the pedal is released.
+ - less RAM: the counter, depth and CV routing of each effect are packed in one record, only
+   the counter of the shown effect is kept to detect changes, presets are written from the
+   settings record in stead of a second buffer and unused timer variables are gone.
+   sim/ram_report.sh reports the static RAM of a nano build per subsystem.
+ - RP2040 port for the arduino-pico core, untested and not built yet. The timers, ports, ADC,
+   pin change interrupts and EEPROM are behind a small hardware abstraction with a version per
+   target. The control rate engine has its own timer on the second core with 12 bit PWM, the
+   UI, the display and the settings (in flash) stay on the first one. The flash is only written
+   when a preset is stored or the calibration is saved.
+
  3. March 2022 v0.2.1
  - For some reason I had created a StensTimerJSB.h file which did not differ significantly from the
    original StensTimer.h, but made it impossible for user moly_wan to compile the code.
@@ -35,12 +119,103 @@
  * B: Time setting mode: choose the delay time using the rotary encoder.
  * 1: Wet signal only mode: only the wet signal (no direct dry signal) is send to the output 
  * 2: Wet and Dry signal mix: the wet signal from the effect units and the dry signal are summed and connected to the output
- * Switch between mode A and B by double pressing the rotary encoder's push button.
- * Switch between mode 1 and 2 by single pressing the rotary encoder's push button.
+ * Switch between mode A and B by single pressing the rotary encoder's push button.
+ * Switch between mode 1 and 2 by double pressing the rotary encoder's push button.
+ * Turn slowly for fine adjustments, the faster you turn the larger the steps get.
+ *
+ * Parameter pages:
+ * In mode B a single press moves on to the next parameter of the effect, after the last one
+ * it goes back to mode A. Besides the time or speed there are:
+ * Pat:   the pattern of the Pattern effect.
+ * Curve: the shape of the sweep of the Decelerator and the Accelerator: Lin, Exp or S.
+ * Depth: the width of the sweep in % (Chorus, Chorus+, WowNotFlut, Psycho and the sweeps).
+ * CV:    what the CV input does: Off, Time (shortens the delay time), Depth or Rate of the sweep.
+ * They are saved with the other settings and in the presets.
+ *
+ * Presets:
+ * Long press the rotary encoder's push button to open the menu. Turn to choose Recall 1 ... 4,
+ * Store 1 ... 4, Calibrate, Self test, Bypass now/2s, Stage on/off or Exit and press to carry it out. A double press closes the menu.
+ * A preset holds the effect, the settings of all effects and the dry signal setting. The
+ * options of the menu (Bypass, Stage) are not part of it.
+ *
+ * Calibrating the delay times:
+ * Choose Calibrate in the menu. Each PT2399 board is then driven at 9 PWM duties
+ * in turn, with the dry signal on as well. Measure the time between the dry signal and its echo
+ * and set it with the rotary encoder, a single press moves on to the next duty (board 1 first,
+ * then board 2). Another long press saves the calibration in EEPROM, a double press leaves
+ * without saving. The display then shows delay times in ms and the 2nd board is driven so its
+ * delay matches the 1st one.
+ * 
+ * Tap tempo:
+ * With Delay or one of the Echo effects selected, tap the pedal (or connect a clock to the pedal
+ * jack) at least twice. The delay time is set to the average of the last 4 intervals, or to the
+ * longest part of it (3/4, 1/2, 3/8, 1/3, 1/4, 1/6 or 1/8) that fits the PT2399 range. A pause
+ * of more than 2 seconds starts a new tempo, turning the encoder leaves the tapped tempo.
  * 
  * The bypass detect pin is not connected in my eurorack hardware version,
  * but its functionality is fully implemented, so you can add 
  * a switch from GND to the BYPASS_DETECT pin if you like.
+ * With Bypass 2s (long press menu) the bypass is delayed: the effect keeps running for 2
+ * seconds after the switch, the input still goes through it, then only the dry signal is
+ * passed. With Bypass now the effect is switched off at once.
+ *
+ * Display:
+ * After 30 seconds without turning or pressing the encoder the display is dimmed, after 50
+ * minutes it is cleared and shows a time warp every minute. With Stage on (long press menu)
+ * the display is switched off after 10 seconds and nothing goes over the I2C bus until you
+ * turn or press the encoder again, so the display can not disturb the sound on stage.
+ *
+ * Self test:
+ * Choose Self test in the menu. Both PWM outputs are stepped through 5 duties and then the
+ * CD4066 switches are turned on one at a time, then all together. The nano checks the PWM compare
+ * registers and the levels on the PWM and switch pins. If the CV input is wired to the filtered
+ * PWM of board 1, it checks that the CV rises with the duty as well (else CV shows n.c.).
+ * Finally press and release the pedal within 10 seconds. The results are shown on the
+ * display and sent to the serial port (115200 baud) as a remote control frame with command 8,
+ * 2 bits per result (PWM, switch, pedal, CV from bit 0: 0 pass, 1 fail, 2 not tested); a DEBUG
+ * build also sends them as text. A press leaves the self test, a double press aborts it.
+ *
+ * Duck echo:
+ * Connect a rectified and smoothed copy of the input signal (0 ... 5V) to A6 and enable
+ * ENVELOPE_INPUT. While the input is above about 0.6V the echoes are switched off, 150 ms after
+ * it dropped below about 0.3V they are switched on again. Without the envelope input Duck echo
+ * is the same as Echo.
+ *
+ * Pattern:
+ * The Pattern effect sets the delay times of both PT2399s and the taps which are heard per
+ * step of a pattern: Dotted (dotted 16th and 8th echoes), Pong (the echo moves from one board
+ * to the other), Trips (triplet echoes), Gallop and Stairs (both boards in series, a longer
+ * delay every beat). Its tempo (40 ... 240 bpm) is set with the encoder or with tap tempo,
+ * the pattern on the Pat: page.
+ *
+ * Decelerator and Accelerator:
+ * While the pedal is held the Decelerator slows the signal down to a halt and mutes it, the
+ * Accelerator speeds it up and stays at the shortest delay. When the pedal is released they
+ * sweep back 4 times as fast, pressing it again on the way back sweeps on from there. The speed
+ * is the time in ms per step, the Curve page chooses whether the sweep moves evenly (Lin),
+ * slowly at first (Exp) or slowly at both ends (S).
+ *
+ * RP2040:
+ * The sketch has a port for RP2040 boards with the arduino-pico core (untested, not built yet),
+ * on the same pin numbers (GPIO) except for the display (SDA 20, SCL 21), the CV input (A2) and
+ * the envelope input (A0).
+ * The inputs and outputs are 3.3V. The settings are only written to the flash when a preset
+ * is stored or the calibration is saved: that stops the modulation for the time the flash
+ * needs, the delay times and the routing are kept. Store a preset to keep changed settings
+ * over a power cycle.
+ *
+ * Remote control:
+ * A sequencer or computer can change the effect, its parameters and the presets over the
+ * serial port (the USB port of the nano, 115200 baud) with 5 byte frames: 0xA5, command,
+ * value low, value high, checksum (command ^ low ^ high). The commands are 1 effect, 2 time or
+ * speed, 3 depth (%), 4 CV routing, 5 no dry signal, 6 recall preset, 7 store preset (0 ... 3)
+ * and 8 the results of the last self test.
+ * Each frame is answered with 0xA5, command + 0x80, the value in use and the checksum.
+ * Compiled with MIDI_REMOTE, the RX pin takes MIDI (31250 baud) on MIDI_CHANNEL: Program
+ * Change 0 ... 3 recalls a preset, CC 20 chooses the effect, CC 21 sets the time or speed,
+ * CC 22 the depth, CC 23 the CV routing and CC 24 the dry signal (64 ... 127: off).
+ * Only these frames are sent over the port (replies and the self test results), status text is
+ * only sent in a DEBUG build.
  *
  * Note on testing the hardware:
  * Bridge the jumper pins on the PCB to get into debug mode. This will:
@@ -64,25 +239,84 @@
 #include <EEPROM.h> 
 #include <Rotary.h>
 
+// Hardware abstraction.
+// The sketch is built for the nano (ATmega328) or, with the arduino-pico core, for an RP2040
+// board. The timers, the ports, the ADC, the pin change interrupts and the EEPROM are only used
+// by the functions marked HAL, which have a version for each target; the effects, the UI and the
+// settings are the same for both.
+// On the RP2040 setup1() creates the alarm pool of the control rate engine on the second core,
+// which is where the SDK runs the timer callbacks of a pool, so drawing the display and the
+// encoder on the first core should not delay its ticks (not yet tested on a board). Both cores
+// share the settings and the engine state in the same globals as on the nano, with a spin lock
+// in place of the interrupt flag: the engine holds it during its tick and ATOMIC_BLOCK takes
+// it, so the UI changes what the engine reads in between two ticks. This is not a lock-free
+// mailbox, but the first core only holds the lock for the few copies and assignments inside an
+// ATOMIC_BLOCK, never while it draws, talks I2C or writes the flash, so a tick starts at most a
+// few us late (PROFILE measures this as jitter) and the engine is the same code for both
+// targets. The flash is only written for an explicit save, see eepromCommit().
+#if defined(ARDUINO_ARCH_RP2040)
+  #define HAL_RP2040
+  #include <hardware/gpio.h>
+  #include <hardware/pwm.h>
+  #include <pico/critical_section.h>
+  #include <pico/time.h>
+  critical_section_t hal_lock;
+  volatile int hal_lock_core = -1; // The core which holds hal_lock, -1 if it is free.
+  struct HalLock {
+    // Holds hal_lock for the lifetime of an ATOMIC_BLOCK, the interrupts of this core are off.
+    // Like ATOMIC_BLOCK on the nano it nests, e.g. the engine's tick setting the switches.
+    bool once;
+    bool nested;
+    HalLock() : once(true) {
+      nested = (hal_lock_core == (int) get_core_num());
+      if (nested == false) {
+        critical_section_enter_blocking(&hal_lock);
+        hal_lock_core = get_core_num();
+      }
+    }
+    ~HalLock() {
+      if (nested == false) {
+        hal_lock_core = -1;
+        critical_section_exit(&hal_lock);
+      }
+    }
+  };
+  #define ATOMIC_RESTORESTATE 0
+  #define ATOMIC_BLOCK(type) for (HalLock hal_block; hal_block.once; hal_block.once = false)
+  #define E2END 1023 // Emulated in flash, as large as the nano's so the layout is the same.
+  #define HAL_I2C_SDA 20 // The default I2C pins (4 and 5) are the CD4066 switches.
+  #define HAL_I2C_SCL 21
+#else
+  #include <util/atomic.h>
+#endif
+
 #include <SPI.h>
 #include <Wire.h>
 #include <Adafruit_GFX.h>
 #include <Adafruit_SSD1306.h>
-#include <StensTimer.h>
 
 //#define DEBUG 
 // Use this and the jumper on the pcb/vero board to debug the hardware.
 // The software will produce some helpful info on the serial port.
 
+//#define PROFILE
+// Use this to time the engine, the display, the EEPROM and the interrupts. Send 'p' over the
+// serial port for a report, 'r' to reset it. Without PROFILE the firmware is not changed at all.
+
+//#define MIDI_REMOTE
+// Use this to connect a MIDI input to the RX pin: the serial port then runs at 31250 baud and
+// takes Program Change and CC messages in stead of the binary remote commands.
+#define MIDI_CHANNEL 1 // 1 ... 16, 0 listens to all channels.
+
 #include <OneButton.h>
 
-const String pgm_version = "v0.2";
+const char pgm_version[] PROGMEM = "v0.3";
 
 #define ON true
 #define OFF false
 
 // Effects definitions.
-#ifndef DEBUG
+// Each effect is described in the effects[] table further on.
 #define DECELERATOR      0 
 #define SHORT_DELAY1     1
 #define DELAY            2
@@ -96,31 +330,183 @@ const String pgm_version = "v0.2";
 #define TELEGRAPH       10
 #define TELEVERB        11
 #define PSYCHO          12
-#define NR_OF_EFFECTS   13
+#define DUCK_ECHO       13 // Added after the effects of v0.2, so their numbers stay the same.
+#define PATTERN         14
+#define ACCELERATOR     15
+#ifndef DEBUG
+#define NR_OF_EFFECTS   16
 #else
 // When debugging the hardware using the DEBUG flag
 // SHORT_DELAY2 is added to test the 2nd PT chip board.
-#define DECELERATOR      0 
-#define SHORT_DELAY1     1 
-#define SHORT_DELAY2     2 
-#define DELAY            3 
-#define ECHO1            4 
-#define ECHO2            5 
-#define ECHO3            6
-#define CHORUS           7 
-#define FAST_CHORUS      8 
-#define REVERB           9 
-#define WOW_NOT_FLUTTER 10
-#define TELEGRAPH       11 
-#define TELEVERB        12 
-#define PSYCHO          13
-#define NR_OF_EFFECTS   14
+#define SHORT_DELAY2    16
+#define NR_OF_EFFECTS   17
 #endif
 
-// EEPROM message memory locations.
-#define EFFECT 0
-#define COUNTER 1 // 1 ... NR_OF_EFFECTS
-#define NO_DRY_SIGNAL (NR_OF_EFFECTS + 1)
+// EEPROM message memory locations of v0.2, only read to take over its settings.
+#define LEGACY_EFFECT 0
+#define LEGACY_NR_OF_EFFECTS 13
+#define LEGACY_COUNTER 1 // 1 ... LEGACY_NR_OF_EFFECTS
+#define LEGACY_NO_DRY_SIGNAL (LEGACY_NR_OF_EFFECTS + 1)
+
+// Delay time calibration.
+// For each PT2399 board the delay time is stored for CALIBRATION_POINTS PWM duties, evenly
+// spaced from 0 to 256 (fully on). In between the curve is interpolated linearly. The times
+// are stored in units of CALIBRATION_MS_PER_UNIT ms, so one byte per point covers 0 ... 510 ms.
+#define NR_OF_BOARDS 2
+#define BOARD1 0 // The PT2399 board driven by DELAY1.
+#define BOARD2 1 // The PT2399 board driven by DELAY2.
+#define CALIBRATION_POINTS 9
+#define CALIBRATION_SPACING 32 // PWM duty between two points.
+#define CALIBRATION_MS_PER_UNIT 2
+#define CALIBRATION_VERSION 1
+// EEPROM layout: version, the points of both boards, CRC8. Stored at the end of the EEPROM.
+#define CALIBRATION_SIZE (1 + NR_OF_BOARDS * CALIBRATION_POINTS + 1)
+#define CALIBRATION_ADDRESS (E2END + 1 - CALIBRATION_SIZE)
+
+// Typical curve of the aliexpress boards: a higher duty gives a shorter delay.
+const byte default_calibration[CALIBRATION_POINTS] PROGMEM = { 170, 140, 113, 90, 70, 53, 38, 25, 15 };
+byte calibration[NR_OF_BOARDS][CALIBRATION_POINTS];
+
+// Settings and presets.
+// The settings are written as a log of records with a sequence number and a CRC8: every write
+// goes to the next slot, so the writes are spread over the EEPROM. At boot the newest valid
+// record wins. A record is 77 bytes, so the log has 9 slots: each byte is
+// written once every 9 saves, which gives about 900000 saves for the 100000 write cycles of
+// the EEPROM. The settings are saved at most once per DELAY_TIME_BEFORE_WRITING_TO_EEPROM_IN_MS
+// after a change, so that is more than plenty and a larger log would not gain anything.
+// The presets are records in fixed slots between the log and the calibration. They hold the
+// effect settings, not the options of the long press menu, which stay as they are on a recall.
+// A record has room for the effects of a DEBUG build as well, so the slots are at the same
+// addresses in every build and a DEBUG build does not overwrite the records of another one.
+// An effect the build does not have is stored with a counter of 0, which is never in range, and
+// the build which has it keeps its own setting for it.
+#define SETTINGS_VERSION 0x91 // Changes with the layout of the record.
+#define SETTINGS_EFFECTS 17   // NR_OF_EFFECTS of a DEBUG build.
+#define NR_OF_PRESETS 4
+struct SettingsRecord {
+  byte version;
+  byte sequence;    // Increments with every write to the log.
+  byte effect;
+  byte no_dry_signal;
+  byte options;     // OPTION_* flags.
+  byte pattern;     // Pattern of the PATTERN effect.
+  byte sweep_shape; // Shape of the sweeps of the DECELERATOR and ACCELERATOR.
+  byte reserved;    // Always 0, keeps counter[] aligned.
+  uint16_t counter[SETTINGS_EFFECTS]; // 0 for an effect this build does not have.
+  byte depth[SETTINGS_EFFECTS];
+  byte cv[SETTINGS_EFFECTS];
+  byte crc;         // CRC8 of the bytes above.
+};
+// The layout is the same for every board: there is no padding before crc, and what a compiler
+// adds after it is not stored.
+static_assert(offsetof(SettingsRecord, counter) == 8, "SettingsRecord has padding");
+static_assert(offsetof(SettingsRecord, crc) == 8 + 4 * SETTINGS_EFFECTS, "SettingsRecord has padding");
+static_assert(NR_OF_EFFECTS <= SETTINGS_EFFECTS, "SettingsRecord has no room for all effects");
+#define RECORD_SIZE (offsetof(SettingsRecord, crc) + 1)
+#define PRESET_ADDRESS (CALIBRATION_ADDRESS - NR_OF_PRESETS * RECORD_SIZE)
+#define SETTINGS_ADDRESS 0
+#define SETTINGS_SLOTS ((PRESET_ADDRESS - SETTINGS_ADDRESS) / RECORD_SIZE)
+int settings_slot = -1;          // Slot of the newest record in the log, -1 if there is none.
+SettingsRecord saved_settings;   // The newest record in the log.
+
+// EEPROM write queue.
+// A write job copies a buffer to the EEPROM in the background: the EEPROM ready interrupt writes
+// one byte (if it differs) and fires again when that write is done, 3.4 ms later. The buffer of a
+// job must not change before the job is done.
+#define EEPROM_JOBS 4
+struct EepromJob {
+  unsigned int address;
+  const byte *data;
+  byte length;
+};
+volatile EepromJob eeprom_jobs[EEPROM_JOBS];
+volatile byte eeprom_job_first = 0;
+volatile byte eeprom_job_count = 0;
+
+// Long press menu.
+#define MENU_RECALL    0 // MENU_RECALL + n: recall preset n.
+#define MENU_STORE     (MENU_RECALL + NR_OF_PRESETS)
+#define MENU_CALIBRATE (MENU_STORE + NR_OF_PRESETS)
+#define MENU_SELFTEST  (MENU_CALIBRATE + 1)
+#define MENU_BYPASS    (MENU_SELFTEST + 1)
+#define MENU_STAGE     (MENU_BYPASS + 1)
+#define MENU_EXIT      (MENU_STAGE + 1)
+#define NR_OF_MENU_ITEMS (MENU_EXIT + 1)
+volatile bool menu_active = false;
+volatile byte menu_item = MENU_RECALL;
+volatile bool menu_chosen = false;
+
+// Calibration mode, entered from the long press menu.
+volatile bool calibrating = false;
+volatile byte calibration_point = 0; // Counts through the points of BOARD1 and then BOARD2.
+#define CALIBRATION_BUSY   0
+#define CALIBRATION_SAVE   1
+#define CALIBRATION_CANCEL 2
+volatile byte calibration_result = CALIBRATION_BUSY;
+
+// Self test, entered from the long press menu. The UI task steps the PWM outputs and the
+// CD4066 switches through a fixed sequence, checks what the nano can measure itself (the
+// compare registers, the pin levels, the CV input if it is wired to the filtered PWM of
+// board 1) and asks for a press of the pedal.
+#define SELFTEST_PWM      0
+#define SELFTEST_SWITCHES 1
+#define SELFTEST_PEDAL    2
+#define SELFTEST_DONE     3
+#define SELFTEST_STEP_MS  400   // Time per step, long enough for the PWM filters to settle.
+#define SELFTEST_PEDAL_MS 10000 // Time to press and release the pedal.
+#define SELFTEST_CV_MIN   0x0800 // Below this at the highest duty the CV input is not wired.
+#define SELFTEST_PWM_STEPS 5
+const unsigned int selftest_duties[SELFTEST_PWM_STEPS] PROGMEM = { 0, 64U << 8, 128U << 8, 192U << 8, 255U << 8 };
+#define SELFTEST_SWITCH_STEPS 6
+#define TEST_PASS    0
+#define TEST_FAIL    1
+#define TEST_SKIPPED 2
+#define RESULT_PWM    0
+#define RESULT_SWITCH 1
+#define RESULT_PEDAL  2
+#define RESULT_CV     3
+#define NR_OF_RESULTS 4
+volatile bool self_testing = false;
+byte selftest_phase = SELFTEST_DONE;
+byte selftest_step = 0;
+bool selftest_applied = false;  // The outputs of the current step are set.
+bool selftest_pedal_down = false;
+unsigned long selftest_time = 0; // millis() at the start of the current step.
+unsigned int selftest_cv[SELFTEST_PWM_STEPS];
+byte selftest_result[NR_OF_RESULTS] = { TEST_SKIPPED, TEST_SKIPPED, TEST_SKIPPED, TEST_SKIPPED };
+
+// Remote control.
+// Commands come in over the serial port. The UART interrupt of the Serial library puts the bytes
+// in its receive buffer, the input task parses at most REMOTE_BYTES_PER_RUN of them per run and
+// changes the settings like the encoder does, so the engine and the display pick them up.
+// Binary frame (115200 baud): REMOTE_SYNC, command, value low byte, value high byte and the
+// checksum command ^ low ^ high. A frame is answered with REMOTE_SYNC, command | 0x80, the value
+// now in use (low, high) and the checksum. When a self test is done, its results are sent as a
+// REMOTE_SELFTEST reply without a command.
+#define REMOTE_SYNC          0xA5
+#define REMOTE_FRAME_SIZE    5
+#define REMOTE_BYTES_PER_RUN 16
+#define REMOTE_EFFECT  1 // Choose an effect.
+#define REMOTE_COUNTER 2 // Time or speed of the current effect, in the units of its counter.
+#define REMOTE_DEPTH   3 // LFO depth of the current effect in percent.
+#define REMOTE_CV      4 // CV routing of the current effect (CV_NONE ... CV_RATE).
+#define REMOTE_DRY     5 // 1: no dry signal, 0: the dry signal is mixed in.
+#define REMOTE_RECALL  6 // Recall preset 0 ... NR_OF_PRESETS - 1.
+#define REMOTE_STORE   7 // Store the settings in preset 0 ... NR_OF_PRESETS - 1.
+#define REMOTE_SELFTEST 8 // Results of the last self test, see selfTestResults().
+// MIDI (MIDI_REMOTE): Program Change n recalls preset n, these controllers set the rest.
+#define MIDI_CC_EFFECT  20 // Effect number.
+#define MIDI_CC_COUNTER 21 // 0 ... 127 over the range of the current effect's counter.
+#define MIDI_CC_DEPTH   22 // 0 ... 127 over 0 ... 100%.
+#define MIDI_CC_CV      23 // 0-31 off, 32-63 time, 64-95 depth, 96-127 rate.
+#define MIDI_CC_DRY     24 // 64 ... 127: no dry signal.
+byte remote_frame[REMOTE_FRAME_SIZE];
+byte remote_length = 0;
+int remote_preset = -1;     // Preset to recall or store once the EEPROM is free.
+bool remote_store = false;
+byte midi_status = 0;       // Running status, 0 if there is none.
+byte midi_controller = 0;
+byte midi_count = 0;        // Data bytes of the current message so far.
 
 // Chorus time constants.
 #define MIN_TIME 80
@@ -129,19 +515,20 @@ const String pgm_version = "v0.2";
      
 #define MAX_FX_NAME_LEN 12
 
-// Decelerator and Tape Wow constants.
+// Text is formatted into one static buffer in stead of String objects on the heap.
+#define TEXT_BUFFER_SIZE 22 // A line of size 1 characters plus the terminating 0.
+#define FSTR(s) ((const __FlashStringHelper *) (s))
+char text_buffer[TEXT_BUFFER_SIZE];
+
+// Decelerator, Accelerator and Tape Wow constants.
 const byte DECELERATOR_counter_min = 20;
 const byte DECELERATOR_counter_max = 120;
-const byte DECELERATOR_counter_start = 90;
 const byte DECELERATOR_UPDATE_TIME_MAX = 100;       
 const byte DECELERATOR_UPDATE_TIME_MIN = 10;
+const byte ACCELERATOR_counter_min = 40;
+const byte ACCELERATOR_counter_max = 200;
 const byte WOW_NOT_FLUTTER_counter_min = 20;
 const byte WOW_NOT_FLUTTER_counter_max = 60;
-const byte WOW_NOT_FLUTTER_TIME_MAX = WOW_NOT_FLUTTER_counter_max;
-byte WOW_NOT_FLUTTER_counter = WOW_NOT_FLUTTER_counter_min;
-byte DECELERATOR_counter = 0;
-bool DECELERATOR_only_once = true;
-#define WOW_NOT_FLUTTER_DELTA 10
 
 // Setup a Rotary Encoder.
 static byte pinA = 3; // The first hardware interrupt pin.
@@ -155,10 +542,16 @@ Rotary rotary = Rotary(pinA, pinB);
 // Rotary Encoder button.
 static byte ENC_PUSH = A1;
 
+// The settings of each effect, packed in one record per effect.
+struct EffectState {
+  unsigned int counter; // The encoder position for the effect, its range and step are in the effect's descriptor.
+  byte depth;           // Sweep width in percent, see PAGE_DEPTH.
+  byte cv_route;        // What the CV does, see CV_NONE ... CV_RATE.
+};
+
 // All interrupt vars are volatile in order to force the C++ optimiser to leave them alone.
-volatile byte counter[NR_OF_EFFECTS]; // This variable stores the current value of the encoder position for each effect. Change to int or uin16_t instead of byte if you want to record a larger range than 0-255.
-volatile byte counter_max[NR_OF_EFFECTS];
-volatile byte old_counter[NR_OF_EFFECTS];// Stores the last encoder position value so we can compare to the current reading and see if it has changed (so we know when to print to the serial monitor).
+volatile EffectState effect_state[NR_OF_EFFECTS];
+unsigned int shown_counter = 0; // The counter of the effect as it was handled last, to see if it has changed.
 volatile byte reading = 0;   // Somewhere to store the direct values we read from our interrupt pins before checking to see if we have moved a whole detent.
 volatile int effect = 0; // This must be an int, to be able to count down past 0.
 int old_effect = -1;     
@@ -170,32 +563,133 @@ volatile bool screen_saver = OFF;
 OneButton button;
 volatile boolean select_mode = true;
 
+// Parameter pages.
+// A single click steps from choosing the effect through the pages of its parameters and back
+// to choosing the effect. Pages which do not apply to the effect are skipped.
+#define PAGE_MAIN    0 // The effect's counter: delay time, speed or tempo.
+#define PAGE_PATTERN 1 // The pattern of the pattern engine, PATTERN only.
+#define PAGE_SHAPE   2 // The shape of the sweep, sweep effects only.
+#define PAGE_DEPTH   3 // Sweep width of the LFO or the sweep in percent.
+#define PAGE_CV      4 // What the CV input modulates, effects with a CV routing only.
+#define NR_OF_PAGES  5
+#define DEPTH_MAX   100
+volatile byte param_page = PAGE_MAIN;
+
 // By default a  mix of wet and dry signals at the output is allowed.
 volatile boolean no_dry_signal = false;
 volatile boolean old_no_dry_signal = !no_dry_signal;
 
+// Options which are saved with the settings, set in the long press menu.
+#define OPTION_DELAYED_BYPASS 0x01 // Keep the effect running for a while when going into bypass.
+#define OPTION_STAGE          0x02 // Performance mode: switch the display off soon and keep the I2C bus quiet.
+#define OPTION_MASK           (OPTION_DELAYED_BYPASS | OPTION_STAGE)
+byte settings_options = 0;
+
 #define DISPLAY_WIDTH 128 // OLED display width, in pixels  => 16 characters of width 7 pixel/character
 #define DISPLAY_HEIGHT 32 // OLED display height, in pixels => 3 lines of characters
 
 // Declaration for an SSD1306 display connected to I2C (SDA, SCL pins)
 #define OLED_RESET   -1 // Reset pin # (or -1 if sharing Arduino reset pin)
-Adafruit_SSD1306 display(DISPLAY_WIDTH, DISPLAY_HEIGHT, &Wire, OLED_RESET);
+#define OLED_ADDRESS 0x3C // Address 0x3C for 128x32
+#define I2C_CLOCK 400000UL
+// Keep the bus at 400 kHz after the library's own transfers as well, our page flushes use it too.
+Adafruit_SSD1306 display(DISPLAY_WIDTH, DISPLAY_HEIGHT, &Wire, OLED_RESET, I2C_CLOCK, I2C_CLOCK);
+bool display_ready = false; // display.begin() succeeded, nothing is drawn otherwise.
+
+// Display power states, set by the screen saver task with SSD1306 commands. While the display
+// is off nothing is sent over I2C, the drawing goes on in the buffer and is flushed on waking.
+#define DISPLAY_ON  0
+#define DISPLAY_DIM 1 // Lowest contrast.
+#define DISPLAY_OFF 2 // Panel switched off, the display RAM keeps its contents.
+byte display_power = DISPLAY_ON;
+
+// Splash screen, comment out SPLASH_SCREEN for an even quicker start.
+#define SPLASH_SCREEN
+#define SPLASH_TIME     0
+#define SPLASH_WARP     1
+#define SPLASH_O        2
+#define SPLASH_CIRCLES1 3
+#define SPLASH_CIRCLES2 4
+#define SPLASH_MATIC    5
+#define SPLASH_VERSION  6
+bool splash_active = false;
+
+// Dirty page administration for the display.
+// The SSD1306 memory is organised in pages of 8 pixel rows. Drawing functions mark the
+// columns they touched per page, displayFlush() only sends those columns and only if the
+// page contents differ from what was sent the last time.
+#define DISPLAY_PAGES (DISPLAY_HEIGHT / 8)
+#define I2C_BUFFER_LENGTH 32 // Size of the Wire library transmit buffer.
+byte dirty_column_min[DISPLAY_PAGES]; // dirty_column_min > dirty_column_max means the page is clean.
+byte dirty_column_max[DISPLAY_PAGES];
+uint16_t page_checksum[DISPLAY_PAGES]; // Checksum of each page as it is on the screen now.
+byte pages_forced = 0;                 // Bit per page: send it even if the checksum matches.
+
+// Time warp animation of the screen saver, drawn by the UI task one circle per frame. A frame
+// sends at most WARP_PAGES_PER_FRAME pages, the next circle waits until the last one is sent.
+#define WARP_IDLE     0
+#define WARP_CIRCLES1 1 // Growing INVERSE circles, so they alternate white/black.
+#define WARP_CIRCLES2 2 // Growing black circles, which wipe the display again.
+#define WARP_PAGES_PER_FRAME 2
+byte warp_step = WARP_IDLE;
+int16_t warp_radius = 0;
 
 // Pin Definitions: 
 // Delay PWM signals TL072B-1/2.
 #define DELAY1 10
 #define DELAY2 9
 
+// High resolution PWM for the delay times.
+// analogWrite() gives 8 bits at 490 Hz on Timer1. With HIRES_PWM defined Timer1 (OC1B = pin 10
+// = DELAY1, OC1A = pin 9 = DELAY2) is set up in phase correct PWM mode with TOP = ICR1 and no
+// prescaler. The carrier frequency is 16 MHz / (2 * TOP): 7.8 kHz for 10 bits, 3.9 kHz for 11 bits
+// and 1.95 kHz for 12 bits, all well above what the TL072 filter stage got before.
+// On the RP2040 the PWM slices of both pins run phase correct at the system clock, 12 bits give
+// 16 kHz at 133 MHz.
+#define HIRES_PWM
+#ifdef HAL_RP2040
+  #define HIRES_PWM_BITS 12 // 10 ... 14
+#else
+  #define HIRES_PWM_BITS 10 // 10 ... 12
+#endif
+#define HIRES_PWM_TOP ((1 << HIRES_PWM_BITS) - 1)
+
 // Switch CD4066
 #define SWA 6
 #define SWB 7
 #define SWC 5
 #define SWD 4 
 
+// The switches are bits 4 ... 7 of PORTD, a routing is the nibble of switch states in those bits.
+// It is written to the port at once, so there are no in between states which could click.
+#define ROUTE_A (1 << SWA)
+#define ROUTE_B (1 << SWB)
+#define ROUTE_C (1 << SWC) // The dry signal.
+#define ROUTE_D (1 << SWD)
+#define ROUTE_MASK (ROUTE_A | ROUTE_B | ROUTE_C | ROUTE_D)
+volatile byte routing_state = 0; // The routing as it was last written.
+
+// HAL: the switches and the levels of the PWM pins.
+// The RP2040 uses the same pin numbers, so GPIO 4 ... 7 are the switches and a routing is set
+// with one masked write as well.
+#ifdef HAL_RP2040
+#define DELAY_PINS ((1UL << DELAY1) | (1UL << DELAY2))
+inline void halWriteRouting(byte routing) { gpio_put_masked(ROUTE_MASK, routing); }
+inline byte halReadRouting(void) { return gpio_get_all() & ROUTE_MASK; }
+inline unsigned long halReadPwmPins(void) { return gpio_get_all() & DELAY_PINS; }
+#else
+#define DELAY_PINS ((1 << PINB1) | (1 << PINB2)) // DELAY2 (9) and DELAY1 (10) on port B.
+// The other bits of PORTD (the pullups of the rotary encoder) are kept.
+inline void halWriteRouting(byte routing) { PORTD = (PORTD & ~ROUTE_MASK) | routing; }
+inline byte halReadRouting(void) { return PIND & ROUTE_MASK; }
+inline byte halReadPwmPins(void) { return PINB & DELAY_PINS; }
+#endif
+
 // Status message text double click choice.
-const String WD = "W+D"; // Wet and Dry signal.
-const String WT = "WET"; // No dry signal.
-const String DR = "DRY"; // Only dry signal.
+const char WD[] PROGMEM = "W+D"; // Wet and Dry signal.
+const char WT[] PROGMEM = "WET"; // No dry signal.
+const char DR[] PROGMEM = "DRY"; // Only dry signal.
+const char *shown_status = 0;    // The status text on the display.
 
 // LED (D2 and D3)
 #define LED1_G 1 
@@ -206,18 +700,107 @@ const String DR = "DRY"; // Only dry signal.
 // On/Off Foot (not implemented in Time-Warp-O-Matic hardware. So if you want to use this 
 // rhis needs to be added to the hardware implementation.)
 #define BYPASS_DETECT 11
+#define BYPASS_BIT (1 << PINB3) // BYPASS_DETECT is PB3, its pin change interrupt is PCINT3.
+// The bypass switch is debounced: a new level counts when it has been stable for this long.
+#define BYPASS_DEBOUNCE_MS 20
+// With OPTION_DELAYED_BYPASS the effect keeps running for this long after going into bypass. It
+// is not a trail: the PT2399 inputs can not be switched off on their own, so what is played
+// during this time goes through the effect as well.
+#define BYPASS_DELAY_MS 2000
+volatile byte pcint0_pins = 0xFF;           // PINB as it was at the last pin change interrupt.
+volatile byte bypass_pin = HIGH;            // BYPASS_DETECT as it was at its last edge.
+volatile unsigned long bypass_edge_ms = 0;  // millis() of the last edge on BYPASS_DETECT.
+bool bypassed = false;                       // The debounced state of the bypass switch.
+unsigned long bypass_since = 0;              // millis() at which bypass was switched on.
+bool bypass_switched = false;                // The switches are set for bypass.
 
 // Contact Foot switch inserted in dedicated jack input.
 #define PEDAL_SWITCH    8
 
-// Reserved port for CV voltage control.
-#define CV1 A7
+// Tap tempo / clock sync for the delay and echo effects.
+// Presses of the pedal (or the pulses of a clock pulling PEDAL_SWITCH low) are timestamped by a pin
+// change interrupt. The average of the last intervals sets the delay time, through the calibration.
+#define TAP_DEBOUNCE_US  20000UL  // The pedal must be released this long before the next press counts.
+#define TAP_TIMEOUT_US 2000000UL  // A longer interval starts a new tempo.
+#define TAP_AVERAGE 4             // Number of intervals that are averaged.
+volatile unsigned long tap_intervals[TAP_AVERAGE];
+volatile byte tap_count = 0;      // Number of valid intervals in tap_intervals.
+volatile byte tap_index = 0;
+volatile bool tap_new = false;    // A new interval came in.
+unsigned long tap_last_press = 0;
+unsigned long tap_last_edge = 0;
+bool tap_released = true;
+
+// The delay time is set to the longest of these parts of a beat which the PT2399s can do.
+struct Subdivision {
+  byte beats;
+  byte per;
+};
+const Subdivision subdivisions[] PROGMEM = { {1, 1}, {3, 4}, {1, 2}, {3, 8}, {1, 3}, {1, 4}, {1, 6}, {1, 8} };
+#define NR_OF_SUBDIVISIONS (sizeof(subdivisions) / sizeof(Subdivision))
+
+// The tempo is used as long as the effect and its counter are not changed.
+int tempo_effect = -1;
+unsigned int tempo_counter = 0;
+unsigned int tempo_duty = 0;
+
+// Port for CV voltage control.
+#ifdef HAL_RP2040
+  #define CV1 A2 // The RP2040 has 4 analog inputs, which take 0 ... 3.3V.
+#else
+  #define CV1 A7
+#endif
+
+// CV input.
+// The ADC converts CV1 continuously (free running, clk/128: 9.6 kHz) and the ADC interrupt writes the
+// results into a small ring buffer. Every control tick the buffer is averaged (oversampling) and
+// smoothed with a one pole low pass filter. Comment out CV_INPUT if nothing is connected to CV1.
+#define CV_INPUT
+#define CV_BUFFER_SIZE 8   // Must be a power of 2.
+#define CV_FILTER_SHIFT 3  // One pole filter coefficient 1/8, a time constant of 8 control ticks.
+#define CV_TIME_RANGE 128  // PWM duty added to a delay time by the maximum CV.
+#define CV_RATE_RANGE 4    // A LFO runs up to this many times faster at the maximum CV.
+volatile unsigned int cv_buffer[CV_BUFFER_SIZE];
+volatile byte cv_write_index = 0;
+unsigned int cv_value = 0; // Filtered CV, 0 ... 65535 for 0 ... 5V.
+
+// What the CV does for each effect.
+#define CV_NONE  0
+#define CV_TIME  1 // Shortens the delay time.
+#define CV_DEPTH 2 // Sets the depth of the LFO, no modulation at 0V.
+#define CV_RATE  3 // Speeds up the LFO.
+
+// Envelope input.
+// A rectified (and smoothed) copy of the input signal on ENV1 lets the audio control the
+// DUCK_ECHO effect. The ADC then alternates between CV1 and ENV1 (4.8 kHz each) and the ADC
+// interrupt runs an envelope follower with a fast attack and a slow release on it.
+// Enable ENVELOPE_INPUT when the rectifier is connected, without it DUCK_ECHO is a plain echo.
+//#define ENVELOPE_INPUT
+#ifdef HAL_RP2040
+  #define ENV1 A0
+#else
+  #define ENV1 A6
+#endif
+#define ENVELOPE_ATTACK_SHIFT  2  // Time constant of 4 samples (about 1 ms).
+#define ENVELOPE_RELEASE_SHIFT 10 // Time constant of 1024 samples (about 200 ms).
+volatile unsigned int envelope = 0; // The input level, 0 ... 65535 for 0 ... 5V.
+
+// Ducking: the echoes are switched off while the input is above DUCK_ON_LEVEL and come back
+// DUCK_HOLD_TICKS after it dropped below DUCK_OFF_LEVEL.
+#define DUCK_ON_LEVEL   0x2000 // About 0.6V.
+#define DUCK_OFF_LEVEL  0x1000
+#define DUCK_HOLD_TICKS 150    // Control ticks (ms).
+unsigned int duck_hold = 0;
+bool engine_ducked = false;
 
 // Jumper on PCB.
 #define DEBUG_JUMPER  12
 
 #define COUNTER_POSITION 9 // Position of delay or time value on display.
+#define MS_POSITION 8      // Position of a delay time in ms on display.
 #define MAX_COUNTER 230    // Maximum delay time.
+#define TIME_STEPS 4       // The counter of a delay effect sets the PWM duty in quarter steps.
+#define DUTY_PER_TIME_STEP (256 / TIME_STEPS)
 
 #define CLEAR_NOT   1
 #define CLEAR_LOCAL 2
@@ -229,107 +812,928 @@ const String DR = "DRY"; // Only dry signal.
 // DEBUG_JUMPER variables
 int delay_variable = 0;
  
-unsigned long delay_currentMillis, delay_previousMillis = 0;  
-
-int direction_up = 1;
-unsigned long currentMillis, previousMillis = 0; 
-unsigned long startTime;
-unsigned long endTime;
-unsigned long duration = 200;
-byte timerRunning = 0;
 bool loopb = false;
 byte effect_status = HIGH;
 
-// Effect initialisations.
-int psycho_counter = 0;
-int chorus_counter = 130;
+// Control rate engine.
+// Timer2 runs in CTC mode and interrupts CONTROL_RATE_HZ times per second: 16 MHz / 128 / (124 + 1).
+// Its PWM pins (3 and 11) are used as inputs in this design, so nothing else depends on Timer2.
+#define CONTROL_RATE_HZ   1000
+#define CONTROL_TIMER_TOP 124
+volatile bool engine_hold = false; // Set while the tasks drive the switches and delays itself (debug, bypass, calibration).
+int engine_effect = -1;            // The effect the engine is running, differs from effect after a change.
+bool engine_refresh = true;        // Force the effect to set its routing and delays again.
+unsigned int engine_duty1 = 0;     // Delay times as they were last applied by a static effect.
+unsigned int engine_duty2 = 0;
+bool engine_no_dry_signal = false; // no_dry_signal as it was last applied.
+byte engine_pedal = HIGH;          // PEDAL_SWITCH as it was last applied.
+
+// Effect transitions.
+// When the effect changes only the dry signal is passed while the PWM outputs glide from the old
+// delay times to the new ones in TRANSITION_TICKS control ticks. Then the new routing is switched
+// on, so the PT2399 clock has settled before its output is heard.
+#define TRANSITION_TICKS 32
+byte transition_ticks = 0;        // Ticks left of the transition, 0 if there is none.
+unsigned int transition_duty1 = 0; // The delay times at the start of the transition.
+unsigned int transition_duty2 = 0;
+unsigned int output_duty1 = 0;     // The delay times on the PWM outputs.
+unsigned int output_duty2 = 0;
+unsigned int effect_duty1 = 0;     // The delay times and routing set by the effect.
+unsigned int effect_duty2 = 0;
+byte effect_routing = 0;
+
+// LFO's.
+// The modulated effects read a waveform table with a 32 bit phase accumulator which is
+// advanced every control tick. The top 8 bits of the phase select the table entry, the
+// next 8 bits interpolate to the next entry, so even slow sweeps move in fine steps.
+#define LFO_SINE        0
+#define LFO_TRIANGLE    1
+#define LFO_RANDOM_WALK 2
+#define NR_OF_LFO_SHAPES 3
+#define LFO_TABLE_SIZE 256
+
+const byte lfo_table[NR_OF_LFO_SHAPES][LFO_TABLE_SIZE] PROGMEM = {
+  { // LFO_SINE
+      0,   0,   0,   0,   1,   1,   1,   2,   2,   3,   4,   5,   5,   6,   7,   9,
+     10,  11,  12,  14,  15,  17,  18,  20,  21,  23,  25,  27,  29,  31,  33,  35,
+     37,  40,  42,  44,  47,  49,  52,  54,  57,  59,  62,  65,  67,  70,  73,  76,
+     79,  82,  85,  88,  90,  93,  97, 100, 103, 106, 109, 112, 115, 118, 121, 124,
+    127, 131, 134, 137, 140, 143, 146, 149, 152, 155, 158, 162, 165, 167, 170, 173,
+    176, 179, 182, 185, 188, 190, 193, 196, 198, 201, 203, 206, 208, 211, 213, 215,
+    218, 220, 222, 224, 226, 228, 230, 232, 234, 235, 237, 238, 240, 241, 243, 244,
+    245, 246, 248, 249, 250, 250, 251, 252, 253, 253, 254, 254, 254, 255, 255, 255,
+    255, 255, 255, 255, 254, 254, 254, 253, 253, 252, 251, 250, 250, 249, 248, 246,
+    245, 244, 243, 241, 240, 238, 237, 235, 234, 232, 230, 228, 226, 224, 222, 220,
+    218, 215, 213, 211, 208, 206, 203, 201, 198, 196, 193, 190, 188, 185, 182, 179,
+    176, 173, 170, 167, 165, 162, 158, 155, 152, 149, 146, 143, 140, 137, 134, 131,
+    128, 124, 121, 118, 115, 112, 109, 106, 103, 100,  97,  93,  90,  88,  85,  82,
+     79,  76,  73,  70,  67,  65,  62,  59,  57,  54,  52,  49,  47,  44,  42,  40,
+     37,  35,  33,  31,  29,  27,  25,  23,  21,  20,  18,  17,  15,  14,  12,  11,
+     10,   9,   7,   6,   5,   5,   4,   3,   2,   2,   1,   1,   1,   0,   0,   0
+  },
+  { // LFO_TRIANGLE
+      0,   2,   4,   6,   8,  10,  12,  14,  16,  18,  20,  22,  24,  26,  28,  30,
+     32,  34,  36,  38,  40,  42,  44,  46,  48,  50,  52,  54,  56,  58,  60,  62,
+     64,  66,  68,  70,  72,  74,  76,  78,  80,  82,  84,  86,  88,  90,  92,  94,
+     96,  98, 100, 102, 104, 106, 108, 110, 112, 114, 116, 118, 120, 122, 124, 126,
+    128, 129, 131, 133, 135, 137, 139, 141, 143, 145, 147, 149, 151, 153, 155, 157,
+    159, 161, 163, 165, 167, 169, 171, 173, 175, 177, 179, 181, 183, 185, 187, 189,
+    191, 193, 195, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 233, 235, 237, 239, 241, 243, 245, 247, 249, 251, 253,
+    255, 253, 251, 249, 247, 245, 243, 241, 239, 237, 235, 233, 231, 229, 227, 225,
+    223, 221, 219, 217, 215, 213, 211, 209, 207, 205, 203, 201, 199, 197, 195, 193,
+    191, 189, 187, 185, 183, 181, 179, 177, 175, 173, 171, 169, 167, 165, 163, 161,
+    159, 157, 155, 153, 151, 149, 147, 145, 143, 141, 139, 137, 135, 133, 131, 129,
+    128, 126, 124, 122, 120, 118, 116, 114, 112, 110, 108, 106, 104, 102, 100,  98,
+     96,  94,  92,  90,  88,  86,  84,  82,  80,  78,  76,  74,  72,  70,  68,  66,
+     64,  62,  60,  58,  56,  54,  52,  50,  48,  46,  44,  42,  40,  38,  36,  34,
+     32,  30,  28,  26,  24,  22,  20,  18,  16,  14,  12,  10,   8,   6,   4,   2
+  },
+  { // LFO_RANDOM_WALK
+      0,   0,   0,   1,   3,   4,   7,   9,  12,  15,  18,  21,  25,  28,  31,  33,
+     35,  38,  39,  41,  42,  42,  43,  44,  44,  45,  46,  47,  49,  51,  54,  58,
+     62,  67,  74,  81,  89,  97, 107, 117, 127, 138, 149, 160, 171, 182, 192, 202,
+    211, 219, 226, 233, 238, 242, 246, 248, 250, 251, 251, 251, 250, 249, 248, 247,
+    246, 245, 245, 245, 245, 246, 247, 248, 249, 251, 252, 254, 255, 255, 255, 254,
+    252, 250, 246, 241, 236, 229, 221, 212, 202, 192, 181, 170, 159, 148, 138, 128,
+    119, 111, 104,  98,  94,  92,  91,  92,  95,  99, 104, 111, 119, 128, 138, 148,
+    159, 170, 180, 191, 200, 209, 217, 224, 230, 235, 238, 240, 241, 241, 239, 237,
+    233, 229, 225, 220, 214, 209, 203, 198, 192, 187, 183, 179, 175, 173, 170, 168,
+    167, 166, 166, 166, 167, 168, 169, 170, 171, 173, 175, 177, 178, 180, 182, 183,
+    185, 186, 188, 189, 190, 191, 191, 192, 192, 192, 191, 190, 189, 188, 185, 183,
+    180, 177, 173, 169, 164, 159, 154, 148, 143, 137, 131, 125, 119, 114, 109, 104,
+     99,  95,  91,  87,  85,  82,  80,  78,  77,  76,  75,  74,  74,  73,  73,  72,
+     71,  70,  68,  66,  64,  62,  59,  57,  54,  50,  47,  44,  41,  37,  34,  32,
+     29,  27,  25,  24,  23,  22,  22,  21,  22,  22,  22,  23,  23,  24,  24,  24,
+     24,  24,  23,  22,  21,  19,  17,  15,  13,  11,   9,   7,   5,   3,   2,   1
+  }
+};
+
+// LFO settings of an effect: waveform, sweep range (PWM duty) and the period in ms
+// as a function of the effect's counter: period = period_base + counter * period_step.
+struct LfoSettings {
+  byte shape;
+  byte lower;
+  byte upper;
+  unsigned int period_base;
+  unsigned int period_step;
+};
+
+// The chorus used to move CHORUS_STEP every MIN_TIME + counter / 2 ms, this keeps that speed.
+#define CHORUS_STEP 2
+#define CHORUS_PERIOD_BASE ((CHORUS_UPPER_LIMIT - CHORUS_LOWER_LIMIT) / CHORUS_STEP * 2 * MIN_TIME)
+#define CHORUS_PERIOD_STEP ((CHORUS_UPPER_LIMIT - CHORUS_LOWER_LIMIT) / CHORUS_STEP)
+#define PSYCHO_LOWER_LIMIT 20
+#define PSYCHO_UPPER_LIMIT 220
+
+const LfoSettings chorus_lfo PROGMEM = { LFO_SINE, CHORUS_LOWER_LIMIT, CHORUS_UPPER_LIMIT, CHORUS_PERIOD_BASE, CHORUS_PERIOD_STEP };
+const LfoSettings fast_chorus_lfo PROGMEM = { LFO_TRIANGLE, CHORUS_LOWER_LIMIT, CHORUS_UPPER_LIMIT, CHORUS_PERIOD_BASE / 2, CHORUS_PERIOD_STEP / 2 };
+const LfoSettings psycho_lfo PROGMEM = { LFO_TRIANGLE, PSYCHO_LOWER_LIMIT, PSYCHO_UPPER_LIMIT, 2 * (PSYCHO_UPPER_LIMIT - PSYCHO_LOWER_LIMIT), PSYCHO_UPPER_LIMIT - PSYCHO_LOWER_LIMIT };
+const LfoSettings wow_not_flutter_lfo PROGMEM = { LFO_RANDOM_WALK, WOW_NOT_FLUTTER_counter_min, WOW_NOT_FLUTTER_counter_max, 2000, 400 };
+
+// State of the running LFO, only used by the control rate engine.
+LfoSettings lfo;
+unsigned long lfo_phase = 0;
+unsigned long lfo_increment = 0;
+unsigned int lfo_counter = 0; // Counter value lfo_increment was computed for.
+byte lfo_depth = 0;           // Depth lfo_bottom and lfo_span were computed for.
+unsigned int lfo_bottom = 0;  // Bottom of the sweep as PWM duty with 8 fractional bits.
+byte lfo_span = 0;            // Width of the sweep in PWM duty steps.
+unsigned int lfo_speed = 256; // Speed factor (Q8.8) of the current period of a random walk.
+// Every period of the random walk runs at a random speed between these (Q8.8), so it never repeats.
+#define RANDOM_SPEED_MIN 128 // 0.5
+#define RANDOM_SPEED_MAX 512 // 2.0
+
+// Fixed point helpers.
+// Q8.8 has 8 integer and 8 fractional bits (the PWM duties, speed factors), Q0.16 is a fraction
+// of 0 ... 65535/65536 (the CV, the LFO waveform). No floating point is used anywhere.
+inline unsigned int scaleQ0_16(unsigned int value, unsigned int fraction) {
+  // value * fraction.
+  return ((unsigned long) value * fraction) >> 16;
+}
+
+inline unsigned long scaleLongQ0_16(unsigned long value, unsigned int fraction) {
+  // value * fraction for a 32 bit value, without overflow.
+  return (value >> 16) * fraction + (((value & 0xFFFF) * fraction) >> 16);
+}
+
+inline unsigned long mulLongQ8_8(unsigned long value, unsigned int factor) {
+  // value * factor, value has to be below 2^32 / factor.
+  return (value >> 8) * factor;
+}
 
-// Screen saver related stuff.
-// stensTimer for 'screensaver'.
-StensTimer* stensTimer;
-Timer *clsTimer;
-Timer *screensaverTimer;
+// Pseudo random numbers.
+// A 16 bit xorshift generator (shifts 7, 9, 8): all 65535 non zero states, a few shifts per number.
+unsigned int prng_state = 0xACE1;
+
+unsigned int xorshift16(void) {
+  unsigned int x = prng_state;
+  x ^= x << 7;
+  x ^= x >> 9;
+  x ^= x << 8;
+  prng_state = x;
+  return x;
+}
 
-// Define actions
-#define CLS_TIMER_ACTION 1
-#define SCREENSAVER_TIMER_ACTION 2
+// Sweep engine.
+// While the pedal is held a sweep moves the delay time of both PT2399s from its start to its end
+// duty along a shape in flash, when the pedal is released it sweeps back (SWEEP_RETURN) or
+// jumps back. The position is a 32 bit accumulator advanced every control tick, like the phase
+// of the LFO's, so the sweep moves in fine steps at any rate in stead of one step per whole ms.
+// The sweep takes the effect's counter in ms per PWM duty step, the depth shortens it.
+#define SWEEP_LINEAR       0
+#define SWEEP_EXPONENTIAL  1 // Slow at first, fast at the end.
+#define SWEEP_S_CURVE      2 // Slow at both ends.
+#define NR_OF_SWEEP_SHAPES 3
+#define SWEEP_TABLE_SIZE   65 // 64 segments, the last entry is the end of the last one.
+
+const byte sweep_table[NR_OF_SWEEP_SHAPES][SWEEP_TABLE_SIZE] PROGMEM = {
+  { // SWEEP_LINEAR
+      0,   4,   8,  12,  16,  20,  24,  28,  32,  36,  40,  44,  48,  52,  56,  60,
+     64,  68,  72,  76,  80,  84,  88,  92,  96, 100, 104, 108, 112, 116, 120, 124,
+    128, 131, 135, 139, 143, 147, 151, 155, 159, 163, 167, 171, 175, 179, 183, 187,
+    191, 195, 199, 203, 207, 211, 215, 219, 223, 227, 231, 235, 239, 243, 247, 251,
+    255
+  },
+  { // SWEEP_EXPONENTIAL
+      0,   1,   1,   2,   3,   4,   4,   5,   6,   7,   8,   9,  10,  11,  12,  14,
+     15,  16,  18,  19,  21,  22,  24,  26,  28,  30,  32,  34,  36,  39,  41,  44,
+     47,  49,  52,  56,  59,  62,  66,  70,  74,  78,  82,  87,  92,  97, 102, 108,
+    113, 119, 126, 133, 140, 147, 155, 163, 171, 180, 189, 199, 209, 220, 231, 243,
+    255
+  },
+  { // SWEEP_S_CURVE
+      0,   0,   1,   2,   3,   4,   6,   8,  11,  14,  17,  20,  24,  27,  31,  35,
+     40,  44,  49,  54,  59,  64,  70,  75,  81,  86,  92,  98, 104, 110, 116, 122,
+    128, 133, 139, 145, 151, 157, 163, 169, 174, 180, 185, 191, 196, 201, 206, 211,
+    215, 220, 224, 228, 231, 235, 238, 241, 244, 247, 249, 251, 252, 253, 254, 255,
+    255
+  }
+};
+const char sweep_linear_name[] PROGMEM = "Lin";
+const char sweep_exponential_name[] PROGMEM = "Exp";
+const char sweep_s_curve_name[] PROGMEM = "S";
+const char *const sweep_shape_names[] PROGMEM = { sweep_linear_name, sweep_exponential_name, sweep_s_curve_name };
+
+#define SWEEP_MUTE   0x01 // Switch the wet signal off at the end of the sweep.
+#define SWEEP_RETURN 0x02 // Sweep back when the pedal is released, with the wet signal on.
+#define SWEEP_RETURN_SPEED 4 // The sweep back is this many times as fast.
+struct SweepSettings {
+  byte start; // PWM duty at the start and at the end of the sweep.
+  byte end;
+  byte flags; // SWEEP_* flags.
+};
+// The signal slows down to a halt and is muted, it speeds up again when the pedal is released.
+const SweepSettings decelerator_sweep PROGMEM = { DECELERATOR_counter_max, DECELERATOR_counter_min, SWEEP_MUTE | SWEEP_RETURN };
+// The signal speeds up and stays at the end until the pedal is released.
+const SweepSettings accelerator_sweep PROGMEM = { ACCELERATOR_counter_min, ACCELERATOR_counter_max, SWEEP_RETURN };
+
+#define SWEEP_IDLE      0 // At the start, the wet signal is off.
+#define SWEEP_FORWARD   1
+#define SWEEP_END       2
+#define SWEEP_BACK      3
+volatile byte sweep_shape = SWEEP_LINEAR; // Saved with the settings.
+byte sweep_state = SWEEP_IDLE;            // Only used by the engine.
+unsigned long sweep_position = 0;         // 0 at the start ... 0xFFFFFFFF at the end.
+unsigned long sweep_rate = 0;             // Step of sweep_position per tick.
+unsigned int sweep_counter = 0;           // Counter and depth sweep_rate was computed for.
+byte sweep_depth = 0;
+
+// Pattern engine.
+// The PATTERN effect steps through a sequence which sets the delay time of each PT2399 and the
+// taps which are heard. The lengths of the steps and the delay times are parts of a beat, so a
+// pattern follows the tempo (its counter in bpm, set with the encoder or tap tempo). The
+// steps are counted in control ticks: the phase grows by PATTERN_UNITS * bpm per tick and a step
+// ends when it reaches length * PATTERN_PHASE_PER_UNIT. The rest is carried to the next step, so
+// the pattern does not drift from the tempo.
+#define PATTERN_UNITS 48 // Parts of a beat (a quarter note) of the step lengths and delay times.
+#define PATTERN_PHASE_PER_UNIT (60UL * CONTROL_RATE_HZ)
+#define PATTERN_BPM_MIN 40
+#define PATTERN_BPM_MAX 240
+struct PatternStep {
+  byte length;  // In PATTERN_UNITS of a beat, 0 ends the pattern.
+  byte time1;   // Delay time of board 1 in PATTERN_UNITS of a beat.
+  byte time2;   // Delay time of board 2 in PATTERN_UNITS of a beat.
+  byte routing; // ROUTE_A: board 1, ROUTE_D: board 2 (both from the input), ROUTE_B: both in series.
+};
+// Dotted sixteenth and eighth echoes, swapping every beat.
+const PatternStep pattern_dotted[] PROGMEM = { {48, 18, 24, ROUTE_A | ROUTE_D}, {48, 24, 18, ROUTE_A | ROUTE_D}, {0, 0, 0, 0} };
+// The echo moves from one board to the other every eighth note.
+const PatternStep pattern_pong[] PROGMEM = { {24, 24, 24, ROUTE_A}, {24, 24, 24, ROUTE_D}, {0, 0, 0, 0} };
+// Triplet and two triplet echoes.
+const PatternStep pattern_triplets[] PROGMEM = { {48, 16, 32, ROUTE_A | ROUTE_D}, {0, 0, 0, 0} };
+// Two sixteenths and an eighth.
+const PatternStep pattern_gallop[] PROGMEM = { {12, 12, 12, ROUTE_A}, {12, 12, 12, ROUTE_D}, {24, 12, 12, ROUTE_B}, {0, 0, 0, 0} };
+// Both boards in series, one step longer every beat.
+const PatternStep pattern_stairs[] PROGMEM = { {48, 6, 6, ROUTE_B}, {48, 9, 9, ROUTE_B}, {48, 12, 12, ROUTE_B}, {48, 16, 16, ROUTE_B}, {0, 0, 0, 0} };
+const PatternStep *const patterns[] PROGMEM = { pattern_dotted, pattern_pong, pattern_triplets, pattern_gallop, pattern_stairs };
+const char pattern_dotted_name[] PROGMEM = "Dotted";
+const char pattern_pong_name[] PROGMEM = "Pong";
+const char pattern_triplets_name[] PROGMEM = "Trips";
+const char pattern_gallop_name[] PROGMEM = "Gallop";
+const char pattern_stairs_name[] PROGMEM = "Stairs";
+const char *const pattern_names[] PROGMEM = { pattern_dotted_name, pattern_pong_name, pattern_triplets_name, pattern_gallop_name, pattern_stairs_name };
+#define NR_OF_PATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+volatile byte pattern_number = 0;  // The chosen pattern, saved with the settings.
+byte pattern_step = 0;             // Step of the running pattern, only used by the engine.
+unsigned long pattern_phase = 0;
+byte engine_pattern = 0;           // pattern_number and the tempo as they were last applied.
+unsigned int engine_bpm = 0;
+unsigned int pattern_duty1 = 0;    // Delay times of the current step.
+unsigned int pattern_duty2 = 0;
+
+// Effect descriptors.
+// Everything the engine and the user interface need to know of an effect, indexed by effect.
+// Adding an effect means adding its number above, its descriptor and (maybe) a tick function.
+void sweepTick(void);
+void delayTick(void);
+void reverbTick(void);
+void chorusTick(void);
+void wowNotFlutterTick(void);
+void telegraphTick(void);
+void televerbTick(void);
+void psychoTick(void);
+void duckTick(void);
+void patternTick(void);
+
+#define FX_DRY        0x01 // The dry signal can be switched on and off with a double click.
+#define FX_MIX        0x02 // The effect mixes in the dry signal itself, W+D is shown.
+#define FX_COUNT_LEFT 0x04 // Turning right counts down: the counter represents a speed.
+#define FX_TAP        0x08 // The delay time (or the tempo) can be set with tap tempo.
+#define FX_PATTERN    0x10 // The effect runs the pattern engine.
+
+// How the counter is shown.
+#define VALUE_FROM      0 // value_base - counter.
+#define VALUE_MS        1 // The delay time of value_base PT2399s in series in ms.
+#define VALUE_REVERB_MS 2 // The longer of the two delay times of the reverb in ms.
+#define VALUE_COUNTER   3 // The counter itself.
+
+struct EffectDescriptor {
+  const char *name;       // Name in flash.
+  const char *label;      // Label of the parameter in flash.
+  void (*tick)(void);     // Called every control tick while the effect is running.
+  const LfoSettings *lfo; // LFO in flash started with the effect, or 0.
+  const SweepSettings *sweep; // Sweep in flash run by sweepTick(), or 0.
+  byte routing;           // ROUTE_* switches, besides ROUTE_C (the dry signal).
+  byte flags;             // FX_* flags.
+  unsigned int counter_min; // Range of the effect's counter.
+  unsigned int counter_max;
+  byte counter_step;      // Change of the counter per detent, multiplied by the encoder acceleration.
+  byte value;             // VALUE_* display of the counter.
+  byte value_base;
+  byte cv;                // Default CV routing.
+};
+
+const char DECELERATOR_name[] PROGMEM = "Deceleratr";
+const char ACCELERATOR_name[] PROGMEM = "Acceleratr";
+const char SHORT_DELAY1_name[] PROGMEM = "Short dly";
+#ifdef DEBUG
+  const char SHORT_DELAY2_name[] PROGMEM = "Short dly2";
+#endif
+const char DELAY_name[] PROGMEM = "Delay";
+const char ECHO1_name[] PROGMEM = "Echo";
+const char ECHO2_name[] PROGMEM = "Echo+";
+const char ECHO3_name[] PROGMEM = "Echo++";
+const char REVERB_name[] PROGMEM = "Reverb";
+const char CHORUS_name[] PROGMEM = "Chorus";
+const char FAST_CHORUS_name[] PROGMEM = "Chorus+";
+const char WOW_NOT_FLUTTER_name[] PROGMEM = "WowNotFlut";
+const char TELEGRAPH_name[] PROGMEM = "Telegraph";
+const char TELEVERB_name[] PROGMEM = "TeleVerb";
+const char PSYCHO_name[] PROGMEM = "Psycho";
+const char DUCK_ECHO_name[] PROGMEM = "Duck echo";
+const char PATTERN_name[] PROGMEM = "Pattern";
+const char time_label[] PROGMEM = "Time:";
+const char speed_label[] PROGMEM = "Speed:";
+const char depth_label[] PROGMEM = "Depth:";
+const char cv_label[] PROGMEM = "CV:";
+const char tempo_label[] PROGMEM = "Tempo:";
+const char pattern_label[] PROGMEM = "Pat:";
+const char shape_label[] PROGMEM = "Curve:";
+const char cv_none_name[] PROGMEM = "Off";
+const char cv_time_name[] PROGMEM = "Time";
+const char cv_depth_name[] PROGMEM = "Depth";
+const char cv_rate_name[] PROGMEM = "Rate";
+const char *const cv_names[] PROGMEM = { cv_none_name, cv_time_name, cv_depth_name, cv_rate_name };
+
+const EffectDescriptor effects[NR_OF_EFFECTS] PROGMEM = {
+  { DECELERATOR_name, speed_label, sweepTick, 0, &decelerator_sweep, 0, 0,
+    DECELERATOR_UPDATE_TIME_MIN, DECELERATOR_UPDATE_TIME_MAX, 1, VALUE_FROM, DECELERATOR_UPDATE_TIME_MAX, CV_NONE },
+  { SHORT_DELAY1_name, time_label, delayTick, 0, 0, ROUTE_A, FX_DRY, TIME_STEPS, MAX_COUNTER * TIME_STEPS, 1, VALUE_MS, 1, CV_TIME },
+  // Do not include the tap 1 signal directly in the output. Both PT2399s are in series.
+  { DELAY_name, time_label, delayTick, 0, 0, ROUTE_B, FX_DRY | FX_TAP, TIME_STEPS, MAX_COUNTER * TIME_STEPS, 1, VALUE_MS, 2, CV_TIME },
+  // Feed forward the dry signal to the 2nd tap.
+  { ECHO1_name, time_label, delayTick, 0, 0, ROUTE_B | ROUTE_D, FX_DRY | FX_TAP, TIME_STEPS, MAX_COUNTER * TIME_STEPS, 1, VALUE_MS, 1, CV_TIME },
+  // Do not feed forward the dry signal to the 2nd tap.
+  { ECHO2_name, time_label, delayTick, 0, 0, ROUTE_A | ROUTE_B, FX_DRY | FX_TAP, TIME_STEPS, MAX_COUNTER * TIME_STEPS, 1, VALUE_MS, 1, CV_TIME },
+  // Include the 'middle tap' signal directly in the output as well.
+  { ECHO3_name, time_label, delayTick, 0, 0, ROUTE_A | ROUTE_B | ROUTE_D, FX_DRY | FX_TAP, TIME_STEPS, MAX_COUNTER * TIME_STEPS, 1, VALUE_MS, 1, CV_TIME },
+  { REVERB_name, time_label, reverbTick, 0, 0, ROUTE_A | ROUTE_D, FX_DRY | FX_COUNT_LEFT, 1, MAX_COUNTER, 2, VALUE_REVERB_MS, 0, CV_TIME },
+  { CHORUS_name, speed_label, chorusTick, &chorus_lfo, 0, ROUTE_A | ROUTE_D, 0, 1, MAX_COUNTER, 1, VALUE_FROM, CHORUS_UPPER_LIMIT, CV_RATE },
+  { FAST_CHORUS_name, speed_label, chorusTick, &fast_chorus_lfo, 0, ROUTE_A | ROUTE_D, 0, 1, MAX_COUNTER, 1, VALUE_FROM, CHORUS_UPPER_LIMIT, CV_RATE },
+  { WOW_NOT_FLUTTER_name, speed_label, wowNotFlutterTick, &wow_not_flutter_lfo, 0, ROUTE_A, FX_COUNT_LEFT,
+    1, MAX_COUNTER, 1, VALUE_FROM, MAX_COUNTER, CV_RATE },
+  { TELEGRAPH_name, time_label, telegraphTick, 0, 0, ROUTE_A, FX_COUNT_LEFT, 1, MAX_COUNTER, 1, VALUE_FROM, MAX_COUNTER, CV_NONE },
+  // Switch the reverbed signal on using the tap key.
+  { TELEVERB_name, time_label, televerbTick, 0, 0, ROUTE_A | ROUTE_D, FX_MIX | FX_COUNT_LEFT, 1, MAX_COUNTER, 1, VALUE_FROM, MAX_COUNTER, CV_NONE },
+  { PSYCHO_name, time_label, psychoTick, &psycho_lfo, 0, ROUTE_A | ROUTE_B | ROUTE_D, FX_DRY | FX_COUNT_LEFT,
+    1, MAX_COUNTER, 1, VALUE_FROM, MAX_COUNTER, CV_RATE },
+  // The echo of ECHO1 which ducks while the input is loud.
+  { DUCK_ECHO_name, time_label, duckTick, 0, 0, ROUTE_B | ROUTE_D, FX_DRY | FX_TAP, TIME_STEPS, MAX_COUNTER * TIME_STEPS, 1, VALUE_MS, 1, CV_TIME },
+  // The routing is set by the steps of the pattern.
+  { PATTERN_name, tempo_label, patternTick, 0, 0, ROUTE_A | ROUTE_D, FX_DRY | FX_COUNT_LEFT | FX_TAP | FX_PATTERN, PATTERN_BPM_MIN, PATTERN_BPM_MAX, 1, VALUE_COUNTER, 0, CV_TIME },
+  // The opposite of the decelerator: the signal speeds up while the pedal is held.
+  { ACCELERATOR_name, speed_label, sweepTick, 0, &accelerator_sweep, 0, 0,
+    DECELERATOR_UPDATE_TIME_MIN, DECELERATOR_UPDATE_TIME_MAX, 1, VALUE_FROM, DECELERATOR_UPDATE_TIME_MAX, CV_NONE },
+  #ifdef DEBUG
+    // This delay should be the same as SHORT_DELAY1. If it is not, then
+    // something is wrong with the 2nd PT2399 board or its PWM signal.
+    { SHORT_DELAY2_name, time_label, delayTick, 0, 0, ROUTE_D, FX_DRY, TIME_STEPS, MAX_COUNTER * TIME_STEPS, 1, VALUE_MS, 1, CV_TIME },
+  #endif
+};
+#define EFFECT_BYTE(fx, field) pgm_read_byte(&effects[fx].field)
+#define EFFECT_PTR(fx, field) pgm_read_ptr(&effects[fx].field)
+#define EFFECT_WORD(fx, field) pgm_read_word(&effects[fx].field)
 
+// Screen saver related stuff, timed by the screen saver task.
 // Choose some timeouts and number of repetitions.
+#define SCREEN_DIM_TIMEOUT 30000L     // Dim the display after 30 seconds.
 #define SCREEN_TIMEOUT 3000000L       // Screen saver timeout in milli seconds (HL: 50 minutes).
+#define STAGE_TIMEOUT 10000L          // With Stage on the display is switched off after 10 seconds.
 #define SCREENSAVER_TIMEOUT 60000L    // Every minute a time warp will be visible on the display.
 #define SCREENSAVER_REPETITION 86400  // Repeat for one whole day should suffice.
+bool user_activity = false;           // Set by the input task and the button handlers, wakes the display.
+unsigned long last_activity = 0;      // millis() of the last rotation or press.
+unsigned long next_warp = 0;          // millis() at which the next time warp is shown.
+unsigned long warps_shown = 0;
+
+// Cooperative scheduler.
+// loop() only runs the scheduler. Each task has a fixed slot, a period and a time budget, the
+// lowest slot number has the highest priority. Per call of runScheduler() one task runs to
+// completion: the most urgent one that is due, so a task never waits for more than one lower
+// priority task. Nothing blocks, the modes (debug, bypass, menu, calibration) are states of the
+// control and UI tasks in stead of while loops. The effects themselves run at the control rate
+// in the Timer2 interrupt, which preempts all tasks.
+struct Task {
+  void (*run)(void);
+  unsigned int period;  // Milli seconds between two runs.
+  unsigned int budget;  // Micro seconds one run should take at most.
+};
+#define TASK_CONTROL     0  // Mode detection, bypass, tap tempo.
+#define TASK_INPUT       1  // The encoder's push button.
+#define TASK_UI          2  // Drawing and sending the display, about 30 Hz.
+#define TASK_SCREENSAVER 3  // Screen saver timeout and time warps.
+#define TASK_PERSIST     4  // Saving the settings in EEPROM.
+#define NR_OF_TASKS      5
+#define UI_PERIOD_MS     33
+unsigned long task_next[NR_OF_TASKS];
+byte task_overruns[NR_OF_TASKS]; // Number of runs that took longer than the budget (saturates).
+
+// The state the control task puts the pedal in, drawn by the UI task.
+#define MODE_NORMAL      0
+#define MODE_SPLASH      1
+#define MODE_MENU        2
+#define MODE_CALIBRATION 3
+#define MODE_BYPASS      4
+#define MODE_DEBUG       5
+#define MODE_SELFTEST    6
+volatile byte ui_mode = MODE_NORMAL;
+byte shown_mode = MODE_NORMAL;
 
 bool writeToEeprom = false;
 unsigned long writeTimer = millis();
 #define DELAY_TIME_BEFORE_WRITING_TO_EEPROM_IN_MS 10000 // Time in milli seconds.
+#define LED_BLINK_TIME 100 // Time in milli seconds, counted down by the control timer.
+volatile byte led_ticks = 0;
+
+// Profiling.
+// A section is timed with micros() (4 us resolution) and the duration goes into its min, max,
+// total and a histogram with bins of doubling width: < 32 us, < 64 us ... < 2048 us, the rest.
+// For PROF_JITTER the deviation of the control tick period from 1 ms is kept.
+#ifdef PROFILE
+  #define PROF_CONTROL    0 // The control tick (the effect update) in the Timer2 interrupt.
+  #define PROF_JITTER     1 // Deviation of the control tick period.
+  #define PROF_INPUT_ISR  2 // The encoder and push button interrupts.
+  #define PROF_EEPROM_ISR 3 // The EEPROM ready interrupt.
+  #define PROF_FLUSH      4 // Sending the display.
+  #define PROF_SAVE       5 // Saving the settings.
+  #define PROF_TASK       6 // One pass of the scheduler.
+  #define NR_OF_PROFILES  7
+  #define PROFILE_BINS    8
+  struct ProfileStats {
+    unsigned long count;
+    unsigned long total;
+    unsigned int min;
+    unsigned int max;
+    unsigned int bins[PROFILE_BINS];
+  };
+  volatile ProfileStats profiles[NR_OF_PROFILES];
+  const char prof_control_name[] PROGMEM = "control";
+  const char prof_jitter_name[] PROGMEM = "jitter";
+  const char prof_input_name[] PROGMEM = "input isr";
+  const char prof_eeprom_name[] PROGMEM = "eeprom isr";
+  const char prof_flush_name[] PROGMEM = "flush";
+  const char prof_save_name[] PROGMEM = "save";
+  const char prof_task_name[] PROGMEM = "task";
+  const char *const profile_names[NR_OF_PROFILES] PROGMEM = {
+    prof_control_name, prof_jitter_name, prof_input_name, prof_eeprom_name, prof_flush_name, prof_save_name, prof_task_name
+  };
+
+  void profileReset(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      memset((void *) profiles, 0, sizeof(profiles));
+      for (byte i = 0; i < NR_OF_PROFILES; i++) {
+        profiles[i].min = 0xFFFF;
+      }
+    }
+  }
 
-// Interrupt Service Routines
-//
-void rotate(void) {
+  void profileRecord(byte id, unsigned long duration) {
+    unsigned int us = (duration > 0xFFFF) ? 0xFFFF : duration;
+    byte bin = 0;
+    while ((bin < PROFILE_BINS - 1) and (us >= (32U << bin))) bin++;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      volatile ProfileStats *stats = &profiles[id];
+      stats->count++;
+      stats->total += us;
+      if (us < stats->min) stats->min = us;
+      if (us > stats->max) stats->max = us;
+      if (stats->bins[bin] < 0xFFFF) stats->bins[bin]++;
+    }
+  }
+
+  void profileReport(void) {
+    Serial.println(F("section count min avg max | <32 <64 <128 <256 <512 <1024 <2048 more (us)"));
+    for (byte i = 0; i < NR_OF_PROFILES; i++) {
+      ProfileStats stats;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        memcpy(&stats, (const void *) &profiles[i], sizeof(stats));
+      }
+      Serial.print(FSTR(pgm_read_ptr(&profile_names[i])));
+      Serial.print(' ');
+      Serial.print(stats.count);
+      if (stats.count > 0) {
+        Serial.print(' ');
+        Serial.print(stats.min);
+        Serial.print(' ');
+        Serial.print(stats.total / stats.count);
+        Serial.print(' ');
+        Serial.print(stats.max);
+      }
+      Serial.print(F(" |"));
+      for (byte bin = 0; bin < PROFILE_BINS; bin++) {
+        Serial.print(' ');
+        Serial.print(stats.bins[bin]);
+      }
+      Serial.println();
+    }
+  }
+
+  void profileCommand(char command) {
+    if (command == 'p') profileReport();
+    if (command == 'r') profileReset();
+  }
+
+  #define PROFILE_START(name) unsigned long profile_##name = micros()
+  #define PROFILE_END(name, id) profileRecord(id, micros() - profile_##name)
+#else
+  #define PROFILE_START(name)
+  #define PROFILE_END(name, id)
+#endif
+
+// Input events.
+// The encoder and push button interrupts only put a one byte event in a ring buffer, the input
+// task takes them out and handles them. There is a single producer at a time (AVR interrupts
+// do not nest) and a single consumer, so the head and tail indices need no lock: only the
+// producer writes input_head and only the consumer writes input_tail.
+#define INPUT_EVENTS     32  // A power of 2, enough for a fast turn during a full display update.
+#define EVENT_CW         1   // One step clock wise.
+#define EVENT_CCW        2   // One step counter clock wise.
+#define EVENT_PRESS      3   // The push button went down.
+#define EVENT_RELEASE    4   // The push button went up.
+#define EVENT_TYPE       0x0F
+#define EVENT_ACCEL(event) ((event) >> 4) // A step is worth 1 << EVENT_ACCEL detents.
+
+// Encoder acceleration: the faster the detents follow each other, the larger the step. A
+// detent within ACCEL_US[i] of the previous one counts 2 << i times (up to 16 times).
+#define NR_OF_ACCEL_LEVELS 4
+const unsigned int ACCEL_US[NR_OF_ACCEL_LEVELS] PROGMEM = { 40000, 20000, 10000, 5000 };
+unsigned long last_detent_us = 0;
+volatile byte input_events[INPUT_EVENTS];
+volatile byte input_head = 0;
+volatile byte input_tail = 0;
+volatile byte input_overflows = 0; // Events lost because the buffer was full.
+
+void inputPush(byte event) {
+  // Called from interrupt context only.
+  byte head = input_head;
+  byte next = (head + 1) & (INPUT_EVENTS - 1);
+  if (next == input_tail) {
+    if (input_overflows < 255) input_overflows++;
+    return;
+  }
+  input_events[head] = event;
+  input_head = next; // Publish the event after it was written.
+}
+
+bool inputPop(byte *event) {
+  // Called from the input task only.
+  byte tail = input_tail;
+  if (tail == input_head) return false;
+  *event = input_events[tail];
+  input_tail = (tail + 1) & (INPUT_EVENTS - 1);
+  return true;
+}
+
+void updateEepromTimer(void);
+
+bool pageAvailable(int fx, byte page) {
+  switch (page) {
+    case PAGE_PATTERN: return (EFFECT_BYTE(fx, flags) & FX_PATTERN) != 0;
+    case PAGE_SHAPE: return EFFECT_PTR(fx, sweep) != 0;
+    case PAGE_DEPTH: return (EFFECT_PTR(fx, lfo) != 0) or (EFFECT_PTR(fx, sweep) != 0);
+    case PAGE_CV:    return EFFECT_BYTE(fx, cv) != CV_NONE;
+    default:         return true;
+  }
+}
+
+void pageCheck(void) {
+  // When the effect is changed from outside the UI (a remote command, a preset) the encoder must
+  // not edit a page the new effect does not have.
+  if (pageAvailable(effect, param_page) == false) param_page = PAGE_MAIN;
+}
+
+byte cvLast(int fx) {
+  // An LFO effect offers all CV routings, the other effects only the delay time.
+  return (EFFECT_PTR(fx, lfo) != 0) ? CV_RATE : CV_TIME;
+}
+
+void cvStep(int fx, byte rotation_direction) {
+  // Step through what the CV can do for the effect.
+  byte last = cvLast(fx);
+  byte route = effect_state[fx].cv_route;
+  if (rotation_direction == DIR_CW) {
+    route = (route >= last) ? CV_NONE : route + 1;
+  } else {
+    route = (route == CV_NONE) ? last : route - 1;
+  }
+  effect_state[fx].cv_route = route;
+}
+
+void encoderStep(byte rotation_direction, byte accel) {
   // count_direction determines whether rotating (counter)clock wise will decrement or increment a
   // counter. It will increment a counter if the counter represents a delay time, if it represents
   // a speed, it will decrement the counter. For each effect the direction is determined when the 
-  // effect is chosen.
-  unsigned char rotation_direction = rotary.process();
-  if (rotation_direction == DIR_CCW) {
-    if (select_mode == true) {
-      effect--; // Choose the previous effect.
-      if (effect < 0) {
-        effect = NR_OF_EFFECTS - 1; // Wrap around.
+  // effect is chosen. Choosing an effect or a menu item is not accelerated.
+  // The control rate engine reads effect and the counters, so they are changed atomically.
+  int steps = 1 << accel;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (calibrating == true) {
+      // Adjust the delay time of the calibration point being measured.
+      byte *point = &calibration[calibration_point / CALIBRATION_POINTS][calibration_point % CALIBRATION_POINTS];
+      int value = *point + ((rotation_direction == DIR_CW) ? steps : -steps);
+      *point = constrain(value, 1, 255);
+    } else if (menu_active == true) {
+      if (rotation_direction == DIR_CW) menu_item = (menu_item + 1) % NR_OF_MENU_ITEMS;
+      if (rotation_direction == DIR_CCW) menu_item = (menu_item + NR_OF_MENU_ITEMS - 1) % NR_OF_MENU_ITEMS;
+    } else if ((select_mode == false) and (param_page == PAGE_PATTERN)) {
+      if (rotation_direction == DIR_CW) pattern_number = (pattern_number + 1) % NR_OF_PATTERNS;
+      if (rotation_direction == DIR_CCW) pattern_number = (pattern_number + NR_OF_PATTERNS - 1) % NR_OF_PATTERNS;
+      updateEepromTimer();
+    } else if ((select_mode == false) and (param_page == PAGE_SHAPE)) {
+      if (rotation_direction == DIR_CW) sweep_shape = (sweep_shape + 1) % NR_OF_SWEEP_SHAPES;
+      if (rotation_direction == DIR_CCW) sweep_shape = (sweep_shape + NR_OF_SWEEP_SHAPES - 1) % NR_OF_SWEEP_SHAPES;
+      updateEepromTimer();
+    } else if ((select_mode == false) and (param_page == PAGE_DEPTH)) {
+      int value = effect_state[effect].depth + ((rotation_direction == DIR_CW) ? steps : -steps);
+      effect_state[effect].depth = constrain(value, 0, DEPTH_MAX);
+      updateEepromTimer();
+    } else if ((select_mode == false) and (param_page == PAGE_CV)) {
+      cvStep(effect, rotation_direction);
+      updateEepromTimer();
+    } else if (select_mode == true) {
+      if (rotation_direction == DIR_CCW) {
+        effect--; // Choose the previous effect.
+        if (effect < 0) {
+          effect = NR_OF_EFFECTS - 1; // Wrap around.
+        }
+      } else {
+        effect++; // Choose the next effect;
+        if (effect > NR_OF_EFFECTS - 1) { 
+          effect = 0; // Wrap around.
+        }
       }
     } else {
-        counter[effect] += count_direction; // De/Increment the effect's speed or delay parameter.
-        if (counter[effect] < 1) { 
-          counter[effect] = 1;
-        } else {
-            if (counter[effect] > MAX_COUNTER) {
-              counter[effect] = MAX_COUNTER;
-            }
-          }
-      }
+      // De/Increment the effect's speed or delay parameter.
+      long value = (long) steps * EFFECT_BYTE(effect, counter_step);
+      value = effect_state[effect].counter + ((rotation_direction == DIR_CCW) ? value * count_direction : -value * count_direction);
+      effect_state[effect].counter = constrain(value, (long) EFFECT_WORD(effect, counter_min), (long) EFFECT_WORD(effect, counter_max));
+    }
   }
-  if (rotation_direction == DIR_CW) {
-    if (select_mode == true) {
-      effect++; // Choose the next effect;
-      if (effect > NR_OF_EFFECTS - 1) { 
-        effect = 0; // Wrap around.
-      }
+}
+
+// Interrupt Service Routines
+//
+void rotate(void) {
+  PROFILE_START(rotate);
+  unsigned char rotation_direction = rotary.process();
+  if (rotation_direction == DIR_NONE) {
+    PROFILE_END(rotate, PROF_INPUT_ISR);
+    return;
+  }
+  // Time the detent for the acceleration.
+  unsigned long now = micros();
+  unsigned long interval = now - last_detent_us;
+  last_detent_us = now;
+  byte accel = 0;
+  while ((accel < NR_OF_ACCEL_LEVELS) and (interval < pgm_read_word(&ACCEL_US[accel]))) accel++;
+  inputPush(((rotation_direction == DIR_CW) ? EVENT_CW : EVENT_CCW) | (accel << 4));
+  PROFILE_END(rotate, PROF_INPUT_ISR);
+}
+
+inline void buttonEdge(bool pressed) {
+  // Queue the edges of ENC_PUSH.
+  PROFILE_START(button);
+  static bool was_pressed = false;
+  if (pressed != was_pressed) {
+    was_pressed = pressed;
+    inputPush(pressed ? EVENT_PRESS : EVENT_RELEASE);
+  }
+  PROFILE_END(button, PROF_INPUT_ISR);
+}
+
+inline void bypassEdge(byte level) {
+  // The bypass switch is only timestamped here, bypassUpdate() debounces it.
+  bypass_pin = level;
+  bypass_edge_ms = millis();
+}
+
+inline void pedalEdge(bool pressed, unsigned long now) {
+  // Timestamp the taps on PEDAL_SWITCH for tap tempo.
+  if (pressed and tap_released and (now - tap_last_edge >= TAP_DEBOUNCE_US)) {
+    unsigned long interval = now - tap_last_press;
+    tap_last_press = now;
+    if (interval > TAP_TIMEOUT_US) {
+      tap_count = 0;
     } else {
-        counter[effect] += -count_direction; // De/Increment the effect's speed or delay parameter.
-        if (counter[effect] < 1) { 
-          counter[effect] = 1;
-        } else {      
-            if (counter[effect] > MAX_COUNTER) {
-              counter[effect] = MAX_COUNTER;
-            }
-          }
+      // Start averaging again when the tempo changes by more than 25%.
+      unsigned long previous = tap_intervals[(tap_index - 1) & (TAP_AVERAGE - 1)];
+      if ((tap_count > 0) and ((interval > previous + (previous >> 2)) or (interval < previous - (previous >> 2)))) {
+        tap_count = 0;
       }
+      tap_intervals[tap_index] = interval;
+      tap_index = (tap_index + 1) & (TAP_AVERAGE - 1);
+      if (tap_count < TAP_AVERAGE) tap_count++;
+      tap_new = true;
+    }
   }
-  // Stop old timer and start new countdown.
-  if (screen_saver == ON) {
-    //stensTimer->deleteTimer(clsTimer);
-    stensTimer->deleteTimers();
-    clsTimer = stensTimer->setTimer(CLS_TIMER_ACTION, SCREEN_TIMEOUT, 1);
-    screensaverTimer = stensTimer->setTimer(SCREENSAVER_TIMER_ACTION, SCREENSAVER_TIMEOUT, SCREENSAVER_REPETITION);
-    screen_saver = OFF;
-    stensTimer->run();
-  }
+  tap_released = !pressed;
+  tap_last_edge = now;
+}
+
+#ifdef HAL_RP2040
+// HAL: every pin has its own edge interrupt.
+void buttonInterrupt(void) {
+  buttonEdge(digitalRead(ENC_PUSH) == LOW); // We use a pullup, so when low it is pressed.
+}
+
+void bypassInterrupt(void) {
+  bypassEdge(digitalRead(BYPASS_DETECT));
+}
+
+void pedalInterrupt(void) {
+  pedalEdge(digitalRead(PEDAL_SWITCH) == LOW, micros());
 }
 
-// The Interrupt Service Routine for ENC_PUSH Change Interrupt 1
-// This routine will only be called on any signal change on ENC_PUSH (H.L. A1): exactly where we need to check.
+void setupPinChangeInterrupts(void) {
+  attachInterrupt(digitalPinToInterrupt(ENC_PUSH), buttonInterrupt, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(PEDAL_SWITCH), pedalInterrupt, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(BYPASS_DETECT), bypassInterrupt, CHANGE);
+}
+#else
+// The Interrupt Service Routine for ENC_PUSH (A1) Change Interrupt 1.
 ISR(PCINT1_vect) {
-  // keep watching the push button:
-  noInterrupts(); // Stop interrupts happening before we read pin values.
-  button.tick();  // Call tick() to check the state.
-  interrupts();
+  buttonEdge((PINC & (1 << PINC1)) == 0); // We use a pullup, so when low it is pressed.
+}
+
+// The Interrupt Service Routine for PEDAL_SWITCH (PB0) Change Interrupt 0.
+// Timer1 input capture (ICP1 is this pin as well) is not available, ICR1 holds the PWM TOP.
+// The bypass switch (PB3) shares this interrupt.
+ISR(PCINT0_vect) {
+  unsigned long now = micros();
+  byte pins = PINB;
+  byte changed = pins ^ pcint0_pins;
+  pcint0_pins = pins;
+  if (changed & BYPASS_BIT) bypassEdge((pins & BYPASS_BIT) ? HIGH : LOW);
+  if (changed & (1 << PINB0)) pedalEdge((pins & (1 << PINB0)) == 0, now); // We use a pullup, so when low it is pressed.
+}
+
+void setupPinChangeInterrupts(void) {
+  // HAL: ENC_PUSH is on Pin Change Interrupt 1, PEDAL_SWITCH and BYPASS_DETECT on 0.
+  // The button edges are queued in order to get a fast response for 'encoder click' and
+  // 'encoder double click' events, the taps on the pedal are timestamped for tap tempo.
+  PCICR |= (1 << PCIE1);    // This enables Pin Change Interrupt 1 that covers the Analog input pins or Port C.
+  PCMSK1 |= (1 << PCINT9);  // This enables the interrupt for pin 1 of Port C: This is A1.
+  PCICR |= (1 << PCIE0);    // This enables Pin Change Interrupt 0 that covers Port B.
+  PCMSK0 |= (1 << PCINT0);  // This enables the interrupt for pin 0 of Port B: This is D8.
+  PCMSK0 |= (1 << PCINT3);  // And for pin 3 of Port B: this is D11, BYPASS_DETECT.
+  pcint0_pins = PINB;
+}
+#endif
+
+void markDisplayDirty(int x, int y, int w, int h) {
+  // Register that the rectangle (x, y, w, h) of the frame buffer has been drawn into.
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > DISPLAY_WIDTH) w = DISPLAY_WIDTH - x;
+  if (y + h > DISPLAY_HEIGHT) h = DISPLAY_HEIGHT - y;
+  if ((w <= 0) or (h <= 0)) return;
+  for (int page = y >> 3; page <= (y + h - 1) >> 3; page++) {
+    if (dirty_column_min[page] > dirty_column_max[page]) {
+      dirty_column_min[page] = x;
+      dirty_column_max[page] = x + w - 1;
+    } else {
+      if (x < dirty_column_min[page]) dirty_column_min[page] = x;
+      if (x + w - 1 > dirty_column_max[page]) dirty_column_max[page] = x + w - 1;
+    }
+  }
+}
+
+void displayInvalidate(void) {
+  // The screen contents are unknown (e.g. after power up), send everything with the next flush.
+  markDisplayDirty(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+  pages_forced = (1 << DISPLAY_PAGES) - 1;
+}
+
+void displayClear(void) {
+  // Use this in stead of display.clearDisplay() so the change is picked up by displayFlush().
+  if (display_ready == false) return;
+  display.clearDisplay();
+  markDisplayDirty(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+}
+
+uint16_t pageChecksum(const uint8_t *page) {
+  // Fletcher style checksum, cheap enough to run over a 128 byte page on every flush.
+  byte sum1 = 0;
+  byte sum2 = 0;
+  for (int i = 0; i < DISPLAY_WIDTH; i++) {
+    sum1 += page[i];
+    sum2 += sum1;
+  }
+  return ((uint16_t) sum2 << 8) | sum1;
+}
+
+void sendPageColumns(byte page, byte first_column, byte last_column, const uint8_t *data) {
+  // Select the window on the SSD1306 and push the column bytes, chunked to fit the Wire buffer.
+  Wire.beginTransmission(OLED_ADDRESS);
+  Wire.write((uint8_t) 0x00); // Command stream.
+  Wire.write((uint8_t) SSD1306_PAGEADDR);
+  Wire.write(page);
+  Wire.write(page);
+  Wire.write((uint8_t) SSD1306_COLUMNADDR);
+  Wire.write(first_column);
+  Wire.write(last_column);
+  Wire.endTransmission();
+  int count = last_column - first_column + 1;
+  data += first_column;
+  while (count > 0) {
+    int chunk = (count < I2C_BUFFER_LENGTH - 1) ? count : I2C_BUFFER_LENGTH - 1;
+    Wire.beginTransmission(OLED_ADDRESS);
+    Wire.write((uint8_t) 0x40); // Data stream.
+    for (int i = 0; i < chunk; i++) {
+      Wire.write(*data++);
+    }
+    Wire.endTransmission();
+    count -= chunk;
+  }
+}
+
+bool displayDirty(void) {
+  // True while there are pages which still have to go through displayFlush().
+  for (byte page = 0; page < DISPLAY_PAGES; page++) {
+    if (dirty_column_min[page] <= dirty_column_max[page]) return true;
+  }
+  return false;
+}
+
+void displayFlush(byte page_budget = DISPLAY_PAGES) {
+  // Replaces display.display(): only dirty pages whose contents changed go over the I2C bus.
+  // At most page_budget pages are sent, the others stay dirty for the next flush. Nothing is
+  // sent while the display is switched off.
+  if ((display_ready == false) or (display_power == DISPLAY_OFF)) return;
+  PROFILE_START(flush);
+  uint8_t *buffer = display.getBuffer();
+  for (byte page = 0; (page < DISPLAY_PAGES) and (page_budget > 0); page++) {
+    if (dirty_column_min[page] > dirty_column_max[page]) continue;
+    uint8_t *page_data = buffer + page * DISPLAY_WIDTH;
+    uint16_t checksum = pageChecksum(page_data);
+    if ((checksum != page_checksum[page]) or (pages_forced & (1 << page))) {
+      sendPageColumns(page, dirty_column_min[page], dirty_column_max[page], page_data);
+      page_checksum[page] = checksum;
+      page_budget--;
+    }
+    dirty_column_min[page] = DISPLAY_WIDTH - 1;
+    dirty_column_max[page] = 0;
+    pages_forced &= ~(1 << page);
+  }
+  PROFILE_END(flush, PROF_FLUSH);
+}
+
+void displayPower(byte state) {
+  // Switch the display on, dim it or switch it off. Only a change is sent to the SSD1306.
+  if (state == display_power) return;
+  if (display_ready == true) {
+    if (state == DISPLAY_OFF) {
+      display.ssd1306_command(SSD1306_DISPLAYOFF);
+    } else {
+      if (display_power == DISPLAY_OFF) display.ssd1306_command(SSD1306_DISPLAYON);
+      display.dim(state == DISPLAY_DIM); // Sets the contrast.
+    }
+  }
+  if (state == DISPLAY_OFF) warp_step = WARP_IDLE;
+  display_power = state;
+}
+
+char *textAppend(char *text, const char *s) {
+  // Copy s to text and return the end of the text. The caller keeps it within TEXT_BUFFER_SIZE.
+  while (*s) *text++ = *s++;
+  *text = '\0';
+  return text;
 }
 
-void displayText(String line_of_text, int field_length, int row, int column, byte clear_mode = CLEAR_LOCAL, int text_size = 2) {
+char *textAppend(char *text, const __FlashStringHelper *s) {
+  const char *p = (const char *) s;
+  char c;
+  while ((c = pgm_read_byte(p++)) != '\0') *text++ = c;
+  *text = '\0';
+  return text;
+}
+
+char *textNumber(char *text, int value, byte width = 0, char pad = ' ') {
+  // Write value in decimal to text, right aligned in width digits, and return the end of the text.
+  if (value < 0) {
+    *text++ = '-';
+    value = -value;
+  }
+  char digits[5];
+  byte n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  for (; width > n; width--) *text++ = pad;
+  while (n > 0) *text++ = digits[--n];
+  *text = '\0';
+  return text;
+}
+
+void displayText(const char *line_of_text, int field_length, int row, int column, byte clear_mode = CLEAR_LOCAL, int text_size = 2) {
   // field_length: length of field to display line_of_text in.
   // This part will be erased when clear_local is set to true.
+  if (display_ready == false) return;
+  int text_length = strlen(line_of_text);
   if (field_length == 0) {
-    field_length = line_of_text.length();
+    field_length = text_length;
   }
   display.setTextColor(SSD1306_WHITE); // Draw white text
   display.cp437(true);                 // Use full 256 char 'Code Page 437' font
@@ -347,82 +1751,151 @@ void displayText(String line_of_text, int field_length, int row, int column, byt
     case CLEAR_NOT:
       break;  
     default:
-      Serial.println("Unknown clear mode");
+      #ifdef DEBUG
+        Serial.println(F("Unknown clear mode"));
+      #endif
+      break;
   }
-  display.setCursor(column * 8, row * 8);      
+  display.setCursor(column * 8, row * 8);
   display.setTextColor(WHITE, BLACK);
   display.print(line_of_text);
-  display.display();
+  // Mark what was cleared and written. The GFX font advances 6 pixels per character.
+  int text_width = text_length * 6 * text_size;
+  if (8 * column + text_width > DISPLAY_WIDTH) {
+    // Text running past the right edge is wrapped by the GFX library onto the next line.
+    markDisplayDirty(0, 8 * row, DISPLAY_WIDTH, 16 * text_size);
+  } else if (clear_mode == CLEAR_LINE) {
+    markDisplayDirty(8 * column, 8 * row, DISPLAY_WIDTH, 8 * text_size);
+  } else {
+    int clear_width = (clear_mode == CLEAR_LOCAL) ? field_length * 7 * text_size : 0;
+    markDisplayDirty(8 * column, 8 * row, (clear_width > text_width) ? clear_width : text_width, 8 * text_size);
+  }
+}
+
+void displayText(const __FlashStringHelper *line_of_text, int field_length, int row, int column, byte clear_mode = CLEAR_LOCAL, int text_size = 2) {
+  textAppend(text_buffer, line_of_text);
+  displayText(text_buffer, field_length, row, column, clear_mode, text_size);
 }
 
 void encoderClick() {
   // Toggle from selecting an effect type to setting a time constant for the delays used.
   #ifdef DEBUG
-    Serial.println("encoder click");
+    Serial.println(F("encoder click"));
   #endif
-  select_mode = !select_mode;
+  if (self_testing == true) {
+    // Leave the self test once it is done.
+    if (selftest_phase == SELFTEST_DONE) self_testing = false;
+    return;
+  }
+  if (calibrating == true) {
+    // Go to the next calibration point.
+    calibration_point = (calibration_point + 1) % (NR_OF_BOARDS * CALIBRATION_POINTS);
+    return;
+  }
+  if (menu_active == true) {
+    // The UI task carries out the chosen menu item.
+    menu_chosen = true;
+    return;
+  }
+  // Step from choosing the effect through its parameter pages.
+  if (select_mode == true) {
+    select_mode = false;
+    param_page = PAGE_MAIN;
+  } else {
+    byte page = param_page + 1;
+    while ((page < NR_OF_PAGES) and (pageAvailable(effect, page) == false)) page++;
+    if (page < NR_OF_PAGES) {
+      param_page = page;
+    } else {
+      select_mode = true;
+    }
+  }
   // Clear line 1 and 2.
-  displayText("", 0, 0, 0, CLEAR_LINE, 2);
-  displayText("", 0, 1, 0, CLEAR_LINE, 2);
-  display.clearDisplay();
-  // Force entering effect switch in loop() and update W+D;
+  displayText(F(""), 0, 0, 0, CLEAR_LINE, 2);
+  displayText(F(""), 0, 1, 0, CLEAR_LINE, 2);
+  displayClear();
+  // Force entering effect switch in the UI task and update W+D;
   loopb = true;
   old_no_dry_signal = !no_dry_signal;
-  screen_saver = OFF;
+  user_activity = true;
 }
 
 void encoderDoubleClick() { 
   // Toggle between adding the dry signal to the output and not sending the dry input signal to the output mixer.
   #ifdef DEBUG
-    Serial.println("encoder double click");
+    Serial.println(F("encoder double click"));
   #endif
+  if (self_testing == true) {
+    // Abort the self test.
+    self_testing = false;
+    return;
+  }
+  if (calibrating == true) {
+    // Leave the calibration mode without saving.
+    calibration_result = CALIBRATION_CANCEL;
+    calibrating = false;
+    return;
+  }
+  if (menu_active == true) {
+    menu_active = false;
+    return;
+  }
 
-  switch(effect) {
-    // Wet and Dry signal.
-    case SHORT_DELAY1:
-    #ifdef DEBUG
-      case SHORT_DELAY2:
-    #endif
-    case DELAY:
-    case ECHO1:
-    case ECHO2:
-    case ECHO3:
-    case REVERB:
-    case PSYCHO:
-      no_dry_signal = !no_dry_signal;
-      digitalWrite(SWC, no_dry_signal);
-      break;
-    // Wet only signal.
-    case WOW_NOT_FLUTTER:      
-    case TELEVERB:
-    case CHORUS:
-    case FAST_CHORUS: 
-    case DECELERATOR:
-    case TELEGRAPH:
-    break;
-    default:
-      Serial.print("1: Unknown effect value: ");
-      Serial.println(effect);
+  if (EFFECT_BYTE(effect, flags) & FX_DRY) {
+    no_dry_signal = !no_dry_signal; // The engine switches SWC in the next control tick.
+  }
+  user_activity = true;
+}
+
+void encoderLongPress() {
+  // Open or close the menu, or leave the calibration mode and save the calibration.
+  #ifdef DEBUG
+    Serial.println(F("encoder long press"));
+  #endif
+  if (self_testing == true) {
+    self_testing = false;
+  } else if (calibrating == true) {
+    calibration_result = CALIBRATION_SAVE;
+    calibrating = false;
+  } else {
+    menu_item = MENU_RECALL;
+    menu_chosen = false;
+    menu_active = !menu_active;
+  }
+  user_activity = true;
+}
+
+void writeRoutingNow(byte routing) {
+  // Set all analog switches of the CD4066 with one write of the port, an interrupt can not
+  // come in between.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    halWriteRouting(routing & ROUTE_MASK);
+    routing_state = routing & ROUTE_MASK;
+  }
+}
+
+void writeRouting(byte routing) {
+  // During a transition the routing is switched on when it ends.
+  effect_routing = routing;
+  if (transition_ticks == 0) {
+    writeRoutingNow(routing);
   }
-  screen_saver = OFF;
 }
 
 void setSwitches(byte swa, byte swb, byte swc, byte swd) {
   // Set analog switches of CD4066.
-  digitalWrite(SWA, swa);
-  digitalWrite(SWB, swb);
-  digitalWrite(SWC, swc);
-  digitalWrite(SWD, swd);
+  writeRouting((swa ? ROUTE_A : 0) | (swb ? ROUTE_B : 0) | (swc ? ROUTE_C : 0) | (swd ? ROUTE_D : 0));
 }
 
 void showSwitchStatus(void) {
-  char a = digitalRead(SWA) == LOW ? 'L': 'H';
-  char b = digitalRead(SWB) == LOW ? 'L': 'H';
-  char c = digitalRead(SWC) == LOW ? 'L': 'H';
-  char d = digitalRead(SWD) == LOW ? 'L': 'H';
-  char tmp[9];
-  sprintf(tmp, "%c%c%c%c ", a, b, c, d);
-  displayText((String) tmp, 0, 0, 12, CLEAR_LOCAL, 1);
+  byte routing = routing_state;
+  text_buffer[0] = (routing & ROUTE_A) ? 'H': 'L';
+  text_buffer[1] = (routing & ROUTE_B) ? 'H': 'L';
+  text_buffer[2] = (routing & ROUTE_C) ? 'H': 'L';
+  text_buffer[3] = (routing & ROUTE_D) ? 'H': 'L';
+  text_buffer[4] = ' ';
+  text_buffer[5] = '\0';
+  displayText(text_buffer, 0, 0, 12, CLEAR_LOCAL, 1);
 
 }
 
@@ -438,155 +1911,1089 @@ void updateEepromTimer(void) {
   writeTimer = millis() + DELAY_TIME_BEFORE_WRITING_TO_EEPROM_IN_MS;
 }
 
-void writeSettingsToEeprom(void) {
-  if ((writeToEeprom == true) and (millis() > writeTimer)) { 
-    writeToEeprom = false;
-    Serial.println("Writing settings to EEPROM.");
-    EEPROM.update(EFFECT, effect);
-    for (int i = 0; i < NR_OF_EFFECTS; i++) {
-      EEPROM.update(COUNTER + i, counter[i]);
+byte crc8(const byte *data, int length) {
+  // CRC-8 with polynomial x^8 + x^2 + x + 1.
+  byte crc = 0;
+  while (length--) {
+    crc ^= *data++;
+    for (byte i = 0; i < 8; i++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
     }
-    EEPROM.update(NO_DRY_SIGNAL, no_dry_signal);
-    toggleLed13();  
-    delay(100);
-    toggleLed13();  
   }
+  return crc;
 }
 
-void readSettingsFromEeprom(void) {
-  // Read important values from EEPROM
-  // First get the effect number used the last time the module was used.
-  effect = EEPROM.read(EFFECT);
-  if ((effect < 0) or (effect > NR_OF_EFFECTS)) {
-    effect = 0;
-    Serial.print("Error reading effect value from eeprom.");
-    EEPROM.write(EFFECT, effect);
+#ifdef HAL_RP2040
+void eepromWrite(unsigned int address, const void *data, byte length) {
+  // HAL: the EEPROM is emulated in flash, a write only goes to its RAM copy.
+  const byte *bytes = (const byte *) data;
+  for (byte i = 0; i < length; i++) {
+    EEPROM.write(address + i, bytes[i]);
   }
+}
 
-  // Second get the delay time.
-  for (int i = 0; i < NR_OF_EFFECTS; i++) {
-    counter[i] = EEPROM.read(COUNTER + i);
-    if ((counter[i] < 0) or (counter[i] > MAX_COUNTER)) {
-      Serial.print("Error reading counter[");
-      Serial.print(i);
-      Serial.println("] value from eeprom.");
-      counter[i] = 100;
-      EEPROM.write(COUNTER + i, counter[i]);
+void eepromCommit(void) {
+  // HAL: write the RAM copy to the flash. While the flash is written the second core is paused,
+  // the PWM outputs and the switches keep their state but the modulation stops, so this is only
+  // done for an explicit save (a preset or the calibration), not for the settings log.
+  EEPROM.commit();
+}
+
+void eepromRead(unsigned int address, void *data, byte length) {
+  byte *bytes = (byte *) data;
+  for (byte i = 0; i < length; i++) {
+    bytes[i] = EEPROM.read(address + i);
+  }
+}
+
+bool eepromBusy(void) {
+  return false;
+}
+
+void eepromWait(void) {
+}
+#else
+ISR(EE_READY_vect) {
+  PROFILE_START(eeprom);
+  while (eeprom_job_count > 0) {
+    volatile EepromJob *job = &eeprom_jobs[eeprom_job_first];
+    if (job->length == 0) {
+      eeprom_job_first = (eeprom_job_first + 1) % EEPROM_JOBS;
+      eeprom_job_count--;
+      continue;
+    }
+    EEAR = job->address++;
+    byte value = *job->data++;
+    job->length--;
+    EECR |= (1 << EERE);
+    if (EEDR != value) {
+      // Erase and write, the interrupt fires again when it is done.
+      EEDR = value;
+      EECR |= (1 << EEMPE);
+      EECR |= (1 << EEPE);
+      PROFILE_END(eeprom, PROF_EEPROM_ISR);
+      return;
     }
   }
+  EECR &= ~(1 << EERIE); // Nothing left to write.
+  PROFILE_END(eeprom, PROF_EEPROM_ISR);
+}
 
-  // Finally get the state of the no_dry_signal variable.
-  byte b = EEPROM.read(NO_DRY_SIGNAL);
-  no_dry_signal = (b == 0) ? false: true;
-  if ((no_dry_signal == false) or (no_dry_signal == true)) {
-    old_no_dry_signal = !no_dry_signal;
-  } else {
-    no_dry_signal = false;
-    EEPROM.write(NO_DRY_SIGNAL, no_dry_signal);
-    Serial.print("Error reading no_dry_signal value from eeprom.");
+void eepromWrite(unsigned int address, const void *data, byte length) {
+  // HAL: queue a write, only waits when the queue is full.
+  bool queued = false;
+  while (queued == false) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (eeprom_job_count < EEPROM_JOBS) {
+        volatile EepromJob *job = &eeprom_jobs[(eeprom_job_first + eeprom_job_count) % EEPROM_JOBS];
+        job->address = address;
+        job->data = (const byte *) data;
+        job->length = length;
+        eeprom_job_count++;
+        EECR |= (1 << EERIE);
+        queued = true;
+      }
+    }
   }
 }
 
-void setDelays(unsigned int delay_time1, unsigned int delay_time2) {
-  // Set PWM on/off ratio for TL072B-1/2.
-  analogWrite(DELAY1, delay_time1);
-  analogWrite(DELAY2, delay_time2);
+bool eepromBusy(void) {
+  return eeprom_job_count > 0;
 }
 
-void showFillCircle1(void) {
-  for (int16_t i = 0; i < DISPLAY_WIDTH / 2; i += 3) {
-    // The INVERSE color is used so circles alternate white/black
-    display.fillCircle(display.width() / 2, display.height() / 2, i, SSD1306_INVERSE);
-    // Update screen with each newly-drawn circle
-    display.display(); 
-    delay(1);
+void eepromCommit(void) {
+  // HAL: the queued writes go to the EEPROM itself, there is nothing to commit.
+}
+
+void eepromWait(void) {
+  // Reading the EEPROM has to wait as well, the interrupt changes EEAR.
+  while (eepromBusy()) {
   }
 }
 
-void showFillCircle2(void) {
-  for (int16_t i = 0; i < DISPLAY_WIDTH / 2; i += 3) {
-    // The INVERSE color is used so circles alternate white/black
-    display.fillCircle(display.width() / 2, display.height() / 2, i, SSD1306_BLACK);
-    // Update screen with each newly-drawn circle
-    display.display(); 
-    delay(1);
+void eepromRead(unsigned int address, void *data, byte length) {
+  eeprom_read_block(data, (const void *) address, length);
+}
+#endif
+
+void blinkLed13(void) {
+  // Show that data is written to the EEPROM, the control timer toggles the LED back.
+  if (led_ticks == 0) {
+    toggleLed13();
   }
+  led_ticks = LED_BLINK_TIME;
 }
 
-void showSplashScreen(void) {
-  display.clearDisplay();  
-  display.setTextSize(2); // Normal 2:1 pixel scale
-  display.clearDisplay();
-  displayText(F("Time"), 0, 1, 4);
-  delay(600);
-  display.clearDisplay();
-  displayText(F("Warp"), 0, 1, 4);
-  delay(600);
-  display.clearDisplay();
-  displayText(F("-O-"), 0, 1, 5);
-  delay(600);
-  showFillCircle1();
-  showFillCircle2();
-  delay(200);
-  display.clearDisplay();  
-  displayText(F("Matic"), 0, 1, 3);
-  delay(600);  
-  displayText(pgm_version, 7, 1, 3, CLEAR_LOCAL, 2);
-  delay(1200);  
-  display.clearDisplay();
-  display.display();
+void fillRecord(SettingsRecord *record, byte sequence) {
+  memset(record, 0, sizeof(SettingsRecord));
+  record->version = SETTINGS_VERSION;
+  record->sequence = sequence;
+  record->effect = effect;
+  record->no_dry_signal = no_dry_signal;
+  record->options = settings_options;
+  record->pattern = pattern_number;
+  record->sweep_shape = sweep_shape;
+  for (int i = 0; i < NR_OF_EFFECTS; i++) {
+    record->counter[i] = effect_state[i].counter;
+    record->depth[i] = effect_state[i].depth;
+    record->cv[i] = effect_state[i].cv_route;
+  }
+  record->crc = crc8((const byte *) record, offsetof(SettingsRecord, crc));
 }
 
-void setupDisplay() {
-  // SSD1306_SWITCHCAPVCC = generate display voltage from 3.3V internally
-  while (!display.begin(SSD1306_SWITCHCAPVCC, 0x3C)) { // Address 0x3C for 128x32
-    Serial.println(F("SSD1306 allocation failed."));
-    delay(1000);
+bool readRecord(int address, SettingsRecord *record) {
+  // Read a record with one block read and check it.
+  eepromWait();
+  eepromRead(address, record, RECORD_SIZE);
+  if ((record->version != SETTINGS_VERSION) or (crc8((const byte *) record, offsetof(SettingsRecord, crc)) != record->crc)) return false;
+  if ((record->effect >= SETTINGS_EFFECTS) or (record->no_dry_signal > 1) or (record->options & ~OPTION_MASK)) return false;
+  if ((record->pattern >= NR_OF_PATTERNS) or (record->sweep_shape >= NR_OF_SWEEP_SHAPES)) return false;
+  for (int i = 0; i < NR_OF_EFFECTS; i++) {
+    if (record->counter[i] == 0) continue; // Written by a build without this effect.
+    if ((record->counter[i] < EFFECT_WORD(i, counter_min)) or (record->counter[i] > EFFECT_WORD(i, counter_max))) return false;
+    if ((record->depth[i] > DEPTH_MAX) or (record->cv[i] > CV_RATE)) return false;
   }
-  Serial.println(F("SSD1306 allocation succeeded!")); 
-  display.clearDisplay();  
-  display.setTextSize(2);  // Normal 2:1 pixel scale
+  return true;
 }
 
-void debugMode(void) {  
-  
-  // This function will run continuously as soon as the 
-  // jumper is bridged on the PCB, connecting D12 to GND.
-  display.setTextSize(1);
-  
-  delay_variable += 10;
-  if (delay_variable > 4000) delay_variable = 0;
-  
-  // Show delay variable on display
-  char tmp[25];
-  sprintf(tmp, "DV:%04d", delay_variable);
-  displayText(tmp, 7, 1, 0, CLEAR_LOCAL, 1);
-
-  sprintf(tmp, "Rot. delay  %d", counter[effect]);
-  displayText(tmp, 15, 2, 0, CLEAR_LOCAL, 1);
-  sprintf(tmp, "Rot. effect %d", effect);
-  displayText(tmp, 13, 3, 0, CLEAR_LOCAL, 1);
-  sprintf(tmp, "Tap %d", digitalRead(PEDAL_SWITCH));
-  displayText(tmp, 5, 4, 0, CLEAR_LOCAL);
-  
-  if (delay_variable < 2000) {
-    setDelays(delay_variable >> 3, delay_variable >> 3); // Every 2s.
-  } else {
-    setDelays(255 - ((delay_variable - 2000) >> 3), 255 - ((delay_variable - 2000) >> 3)); // Every 2s.
+void applyRecord(const SettingsRecord *record, bool with_options) {
+  // The options are only taken from the settings log, a preset leaves them as they are.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    effect = (record->effect < NR_OF_EFFECTS) ? record->effect : 0;
+    for (int i = 0; i < NR_OF_EFFECTS; i++) {
+      if (record->counter[i] == 0) continue;
+      effect_state[i].counter = record->counter[i];
+      effect_state[i].depth = record->depth[i];
+      effect_state[i].cv_route = record->cv[i];
+    }
+    no_dry_signal = record->no_dry_signal;
+    if (with_options) settings_options = record->options;
+    pattern_number = record->pattern;
+    sweep_shape = record->sweep_shape;
+    pageCheck();
   }
-  #ifdef DEBUG  
-    Serial.print("Tap Detect: ");
+  old_no_dry_signal = !no_dry_signal;
+}
+
+bool saveSettings(void) {
+  // Append the settings to the log, unless they did not change since the last record.
+  // saved_settings is the buffer of the write, so the previous write has to be done.
+  SettingsRecord record;
+  byte sequence = (settings_slot < 0) ? 0 : saved_settings.sequence + 1;
+  fillRecord(&record, sequence);
+  if ((settings_slot >= 0) and (memcmp(&record.effect, &saved_settings.effect, offsetof(SettingsRecord, crc) - offsetof(SettingsRecord, effect)) == 0)) return false;
+  eepromWait();
+  settings_slot = (settings_slot + 1) % SETTINGS_SLOTS;
+  saved_settings = record;
+  eepromWrite(SETTINGS_ADDRESS + settings_slot * RECORD_SIZE, &saved_settings, RECORD_SIZE);
+  return true;
+}
+
+void writeSettingsToEeprom(void) {
+  // The write itself is done in the background, try again later while the EEPROM is busy.
+  if ((writeToEeprom == true) and (millis() > writeTimer) and (eepromBusy() == false)) { 
+    writeToEeprom = false;
+    PROFILE_START(save);
+    bool saved = saveSettings();
+    PROFILE_END(save, PROF_SAVE);
+    if (saved) {
+      #ifdef DEBUG
+        Serial.println(F("Writing settings to EEPROM."));
+      #endif
+      blinkLed13();
+    }
+  }
+}
+
+void readLegacySettings(void) {
+  // Take over the settings of v0.2, or use defaults for whatever is not valid.
+  effect = EEPROM.read(LEGACY_EFFECT);
+  if (effect >= NR_OF_EFFECTS) {
+    effect = 0;
+    #ifdef DEBUG
+      Serial.println(F("Error reading effect value from eeprom."));
+    #endif
+  }
+  for (int i = 0; i < NR_OF_EFFECTS; i++) {
+    // v0.2 set the delay times in whole PWM duty steps.
+    unsigned int scale = (EFFECT_BYTE(i, value) == VALUE_MS) ? TIME_STEPS : 1;
+    effect_state[i].counter = (i < LEGACY_NR_OF_EFFECTS) ? EEPROM.read(LEGACY_COUNTER + i) * scale : 0;
+    if ((effect_state[i].counter < EFFECT_WORD(i, counter_min)) or (effect_state[i].counter > EFFECT_WORD(i, counter_max))) {
+      #ifdef DEBUG
+        Serial.print(F("Error reading counter["));
+        Serial.print(i);
+        Serial.println(F("] value from eeprom."));
+      #endif
+      effect_state[i].counter = 100 * scale;
+    }
+    effect_state[i].depth = DEPTH_MAX;
+  }
+  no_dry_signal = (EEPROM.read(LEGACY_NO_DRY_SIGNAL) == 1) ? true : false;
+  old_no_dry_signal = !no_dry_signal;
+}
+
+void readSettingsFromEeprom(void) {
+  // Find the newest valid record in the log. Only the records which are newer than the best
+  // one so far are read and checked completely.
+  SettingsRecord record;
+  settings_slot = -1;
+  for (int slot = 0; slot < (int) SETTINGS_SLOTS; slot++) {
+    int address = SETTINGS_ADDRESS + slot * RECORD_SIZE;
+    if (EEPROM.read(address) != SETTINGS_VERSION) continue;
+    byte sequence = EEPROM.read(address + 1);
+    if ((settings_slot >= 0) and ((signed char) (sequence - saved_settings.sequence) <= 0)) continue;
+    if (readRecord(address, &record)) {
+      settings_slot = slot;
+      saved_settings = record;
+    }
+  }
+  if (settings_slot >= 0) {
+    applyRecord(&saved_settings, true);
+  } else {
+    readLegacySettings();
+    saveSettings();
+  }
+}
+
+void storePreset(byte preset) {
+  // The settings are brought up to date first, then the newest record is the buffer of the write.
+  saveSettings();
+  eepromWrite(PRESET_ADDRESS + preset * RECORD_SIZE, &saved_settings, RECORD_SIZE);
+  eepromCommit(); // Also takes the settings log along on the RP2040.
+  blinkLed13();
+}
+
+bool recallPreset(byte preset) {
+  SettingsRecord record;
+  if (readRecord(PRESET_ADDRESS + preset * RECORD_SIZE, &record) == false) return false;
+  applyRecord(&record, false);
+  updateEepromTimer(); // The recalled settings become the settings to start with.
+  return true;
+}
+
+void readCalibrationFromEeprom(void) {
+  byte data[CALIBRATION_SIZE];
+  eepromWait();
+  eepromRead(CALIBRATION_ADDRESS, data, CALIBRATION_SIZE);
+  if ((data[0] == CALIBRATION_VERSION) and (crc8(data, CALIBRATION_SIZE - 1) == data[CALIBRATION_SIZE - 1])) {
+    memcpy(calibration, data + 1, sizeof(calibration));
+  } else {
+    #ifdef DEBUG
+      Serial.println(F("No delay time calibration in eeprom, using defaults."));
+    #endif
+    for (byte board = 0; board < NR_OF_BOARDS; board++) {
+      memcpy_P(calibration[board], default_calibration, CALIBRATION_POINTS);
+    }
+  }
+}
+
+void writeCalibrationToEeprom(void) {
+  static byte data[CALIBRATION_SIZE]; // Buffer of the write.
+  eepromWait();
+  data[0] = CALIBRATION_VERSION;
+  memcpy(data + 1, calibration, sizeof(calibration));
+  data[CALIBRATION_SIZE - 1] = crc8(data, CALIBRATION_SIZE - 1);
+  #ifdef DEBUG
+    Serial.println(F("Writing calibration to EEPROM."));
+  #endif
+  eepromWrite(CALIBRATION_ADDRESS, data, CALIBRATION_SIZE);
+  eepromCommit();
+  blinkLed13();
+}
+
+unsigned int delayTimeMs(byte board, unsigned int duty) {
+  // Delay time of a board for a PWM duty (0 ... 255 with 8 fractional bits).
+  byte segment = duty >> 13;             // 32 << 8 duty units per segment.
+  byte fraction = (duty & 0x1FFF) >> 5;  // Position within the segment, 0 ... 255.
+  unsigned int a = calibration[board][segment];
+  unsigned int b = calibration[board][segment + 1];
+  return ((unsigned long) (a * (256 - fraction) + b * fraction) * CALIBRATION_MS_PER_UNIT) >> 8;
+}
+
+unsigned int dutyForDelayTime(byte board, unsigned int ms) {
+  // Inverse of delayTimeMs(): the PWM duty (8 fractional bits) which gives a delay of ms.
+  // The curve may rise or fall, but should be monotonic. Times outside the curve are clipped.
+  unsigned long units = ((unsigned long) ms << 8) / CALIBRATION_MS_PER_UNIT; // 8 fractional bits.
+  const byte *points = calibration[board];
+  bool falling = points[CALIBRATION_POINTS - 1] < points[0];
+  for (byte segment = 0; segment < CALIBRATION_POINTS - 1; segment++) {
+    unsigned int a = (unsigned int) points[segment] << 8;
+    unsigned int b = (unsigned int) points[segment + 1] << 8;
+    if (falling ? (units >= b) : (units <= b)) {
+      if (falling ? (units > a) : (units < a)) units = a; // Beyond the start of the curve.
+      unsigned int span = falling ? a - b : b - a;
+      unsigned int offset = falling ? a - units : units - a;
+      unsigned int fraction = span ? ((unsigned long) offset << 8) / span : 0; // 0 ... 256.
+      unsigned long duty = ((unsigned long) segment << 13) + (fraction << 5);
+      return (duty > 0xFFFF) ? 0xFFFF : duty;
+    }
+  }
+  return 0xFFFF; // Beyond the end of the curve.
+}
+
+#ifdef HIRES_PWM
+#ifdef HAL_RP2040
+void setupHiResPwm(void) {
+  // HAL: phase correct PWM with TOP = HIRES_PWM_TOP at the system clock on the slices of both pins.
+  const byte pins[NR_OF_BOARDS] = { DELAY1, DELAY2 };
+  for (byte board = 0; board < NR_OF_BOARDS; board++) {
+    unsigned int slice = pwm_gpio_to_slice_num(pins[board]);
+    gpio_set_function(pins[board], GPIO_FUNC_PWM);
+    pwm_set_wrap(slice, HIRES_PWM_TOP);
+    pwm_set_phase_correct(slice, true);
+    pwm_set_clkdiv(slice, 1.0f);
+    pwm_set_gpio_level(pins[board], 0);
+    pwm_set_enabled(slice, true);
+  }
+}
+
+inline void halWritePwm(unsigned int compare1, unsigned int compare2) {
+  pwm_set_gpio_level(DELAY1, compare1);
+  pwm_set_gpio_level(DELAY2, compare2);
+}
+
+unsigned int halReadPwm(byte board) {
+  // The compare level as the slice has it.
+  byte pin = (board == BOARD1) ? DELAY1 : DELAY2;
+  unsigned int slice = pwm_gpio_to_slice_num(pin);
+  unsigned int cc = pwm_hw->slice[slice].cc;
+  return (pwm_gpio_to_channel(pin) == PWM_CHAN_A) ? (cc & 0xFFFF) : (cc >> 16);
+}
+#else
+void setupHiResPwm(void) {
+  // HAL: phase correct PWM with TOP = ICR1 (mode 10), clk/1, non inverting outputs on OC1A and OC1B.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    TCCR1A = (1 << COM1A1) | (1 << COM1B1) | (1 << WGM11);
+    TCCR1B = (1 << WGM13) | (1 << CS10);
+    ICR1 = HIRES_PWM_TOP;
+    OCR1A = 0;
+    OCR1B = 0;
+  }
+}
+
+inline void halWritePwm(unsigned int compare1, unsigned int compare2) {
+  // Timer1's 16 bit registers share one temporary byte register, so write them atomically.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    OCR1B = compare1;
+    OCR1A = compare2;
+  }
+}
+
+inline unsigned int halReadPwm(byte board) {
+  return (board == BOARD1) ? OCR1B : OCR1A;
+}
+#endif
+
+unsigned int dutyToCompareValue(unsigned int duty) {
+  // Like analogWrite(255), a duty of 255 (or more) means always on, i.e. OCR1x = TOP.
+  if (duty >= (255U << 8)) return HIRES_PWM_TOP;
+  return duty >> (16 - HIRES_PWM_BITS);
+}
+#endif
+
+void writeDelays(unsigned int delay_time1, unsigned int delay_time2) {
+  // Set PWM on/off ratio for TL072B-1/2. The delay times are PWM duties on the same
+  // 0 ... 255 scale as setDelays(), with 8 extra fractional bits.
+  output_duty1 = delay_time1;
+  output_duty2 = delay_time2;
+  #ifdef HIRES_PWM
+    halWritePwm(dutyToCompareValue(delay_time1), dutyToCompareValue(delay_time2));
+  #else
+    analogWrite(DELAY1, delay_time1 >> 8);
+    analogWrite(DELAY2, delay_time2 >> 8);
+  #endif
+}
+
+void setDelaysHiRes(unsigned int delay_time1, unsigned int delay_time2) {
+  // During a transition the engine glides to these delay times.
+  effect_duty1 = delay_time1;
+  effect_duty2 = delay_time2;
+  if (transition_ticks == 0) {
+    writeDelays(delay_time1, delay_time2);
+  }
+}
+
+void setDelaysMatched(unsigned int delay_time1, unsigned int delay_time2) {
+  // Like setDelaysHiRes(), but the duty of the 2nd board is corrected with the calibration
+  // curves so it gives the delay time the 1st board would give for delay_time2.
+  setDelaysHiRes(delay_time1, dutyForDelayTime(BOARD2, delayTimeMs(BOARD1, delay_time2)));
+}
+
+void setDelays(unsigned int delay_time1, unsigned int delay_time2) {
+  // Set PWM on/off ratio for TL072B-1/2 with 8 bit duties.
+  setDelaysHiRes((delay_time1 > 255) ? 0xFFFF : delay_time1 << 8, (delay_time2 > 255) ? 0xFFFF : delay_time2 << 8);
+}
+
+#if defined(CV_INPUT) or defined(ENVELOPE_INPUT)
+#ifdef ENVELOPE_INPUT
+inline void envelopeSample(unsigned int sample) {
+  // Follow the level, fast when it goes up, slowly when it goes down.
+  unsigned int level = sample << 6;
+  unsigned int env = envelope;
+  if (level > env) {
+    env += (level - env) >> ENVELOPE_ATTACK_SHIFT;
+  } else {
+    env -= (env - level) >> ENVELOPE_RELEASE_SHIFT;
+  }
+  envelope = env;
+}
+#endif
+
+#ifdef HAL_RP2040
+#define ENVELOPE_SAMPLES_PER_TICK 5 // About the rate of the nano, for the same time constants.
+
+void setupAdc(void) {
+  // HAL: the inputs are read by the engine's tick, see halSampleInputs().
+  analogReadResolution(10);
+}
+
+void halSampleInputs(void) {
+  // A conversion takes 2 us, so a tick fills the whole CV buffer and runs the envelope follower
+  // a few times.
+  #ifdef CV_INPUT
+    for (byte i = 0; i < CV_BUFFER_SIZE; i++) {
+      cv_buffer[i] = analogRead(CV1);
+    }
+  #endif
+  #ifdef ENVELOPE_INPUT
+    for (byte i = 0; i < ENVELOPE_SAMPLES_PER_TICK; i++) {
+      envelopeSample(analogRead(ENV1));
+    }
+  #endif
+}
+#else
+#define ADC_MUX(pin) ((1 << REFS0) | (((pin) - A0) & 0x07)) // AVcc as reference, right adjusted.
+
+ISR(ADC_vect) {
+  unsigned int sample = ADC;
+  #if defined(CV_INPUT) and defined(ENVELOPE_INPUT)
+    // Alternate between the channels. In free running mode the conversion that has just started
+    // still uses the previous channel, so this result belongs to the channel selected two
+    // interrupts ago, which is the one selected now.
+    static bool env_channel = false;
+    env_channel = !env_channel;
+    ADMUX = ADC_MUX(env_channel ? ENV1 : CV1);
+    if (env_channel) {
+      envelopeSample(sample);
+    } else {
+      cv_buffer[cv_write_index++ & (CV_BUFFER_SIZE - 1)] = sample;
+    }
+  #elif defined(ENVELOPE_INPUT)
+    envelopeSample(sample);
+  #else
+    cv_buffer[cv_write_index++ & (CV_BUFFER_SIZE - 1)] = sample;
+  #endif
+}
+
+void setupAdc(void) {
+  // HAL: free running conversions with interrupt at clk/128 (9.6 kHz).
+  #ifdef CV_INPUT
+    ADMUX = ADC_MUX(CV1);
+  #else
+    ADMUX = ADC_MUX(ENV1);
+  #endif
+  ADCSRB = 0;
+  ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIE) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+}
+#endif
+#endif
+
+void setupCvRouting(void) {
+  for (int i = 0; i < NR_OF_EFFECTS; i++) {
+    effect_state[i].cv_route = EFFECT_BYTE(i, cv);
+  }
+}
+
+void cvUpdate(void) {
+  // Oversample the ring buffer and low pass filter the result. Called from the control tick, the
+  // ADC interrupt can not change the buffer in the mean time.
+  #ifdef CV_INPUT
+    unsigned int sum = 0;
+    for (byte i = 0; i < CV_BUFFER_SIZE; i++) {
+      sum += cv_buffer[i];
+    }
+    unsigned int sample = sum << (16 - 10 - 3); // 8 10 bit samples scaled to 16 bits.
+    cv_value += ((long) sample - (long) cv_value) >> CV_FILTER_SHIFT;
+  #endif
+}
+
+unsigned int cvTime(unsigned int duty) {
+  // Add the CV to a delay time (PWM duty with 8 fractional bits) if it is routed there.
+  if (effect_state[engine_effect].cv_route != CV_TIME) return duty;
+  unsigned long result = duty + (unsigned long) scaleQ0_16((unsigned int) CV_TIME_RANGE << 8, cv_value);
+  return (result > ((unsigned int) MAX_COUNTER << 8)) ? (unsigned int) MAX_COUNTER << 8 : result;
+}
+
+void lfoStart(const LfoSettings *settings) {
+  // Copy the effect's LFO settings from flash and start at the bottom of the waveform.
+  memcpy_P(&lfo, settings, sizeof(LfoSettings));
+  lfo_phase = 0;
+  lfo_increment = 0;
+  lfo_depth = DEPTH_MAX + 1; // Compute the sweep in the first step.
+  lfo_speed = 256;
+}
+
+void lfoSetDepth(byte depth_value) {
+  // Narrow the sweep range around its center to depth_value percent.
+  if (depth_value != lfo_depth) {
+    lfo_depth = depth_value;
+    lfo_span = (unsigned int) (lfo.upper - lfo.lower) * depth_value / DEPTH_MAX;
+    lfo_bottom = ((unsigned int) (lfo.lower + lfo.upper) << 7) - ((unsigned int) lfo_span << 7);
+  }
+}
+
+void lfoSetRate(unsigned int counter_value) {
+  // All LFO effects share this mapping of their counter to a rate. The 32 bit division is
+  // only done when the counter has changed.
+  if ((counter_value != lfo_counter) or (lfo_increment == 0)) {
+    lfo_counter = counter_value;
+    unsigned long period = (lfo.period_base + (unsigned long) counter_value * lfo.period_step) * CONTROL_RATE_HZ / 1000;
+    lfo_increment = 0xFFFFFFFFUL / (period ? period : 1);
+  }
+}
+
+unsigned int lfoStep(void) {
+  // Advance the LFO by one control tick, return its position in the sweep range as
+  // a PWM duty with 8 fractional bits.
+  lfoSetDepth(effect_state[engine_effect].depth);
+  unsigned long increment = lfo_increment;
+  byte route = effect_state[engine_effect].cv_route;
+  if (route == CV_RATE) {
+    increment += scaleLongQ0_16(increment, cv_value) * (CV_RATE_RANGE - 1);
+  }
+  if (lfo.shape == LFO_RANDOM_WALK) {
+    increment = mulLongQ8_8(increment, lfo_speed);
+  }
+  unsigned long previous = lfo_phase;
+  lfo_phase += increment;
+  if ((lfo.shape == LFO_RANDOM_WALK) and (lfo_phase < previous)) {
+    lfo_speed = RANDOM_SPEED_MIN + xorshift16() % (RANDOM_SPEED_MAX - RANDOM_SPEED_MIN + 1);
+  }
+  byte index = lfo_phase >> 24;
+  byte fraction = lfo_phase >> 16;
+  const byte *table = lfo_table[lfo.shape];
+  unsigned int a = pgm_read_byte(table + index);
+  unsigned int b = pgm_read_byte(table + (byte) (index + 1));
+  unsigned int wave = a * (256 - fraction) + b * fraction; // 0 ... 255 * 256.
+  if (route == CV_DEPTH) {
+    wave = scaleQ0_16(wave, cv_value);
+  }
+  return lfo_bottom + scaleQ0_16((unsigned int) lfo_span << 8, wave);
+}
+
+void setRouting(byte routing, byte swc) {
+  writeRouting(swc ? routing | ROUTE_C : routing & ~ROUTE_C);
+}
+
+void enterEffect(int fx) {
+  // Called by the engine when a new effect is started: reset its modulation state.
+  engine_refresh = true;
+  const LfoSettings *settings = (const LfoSettings *) EFFECT_PTR(fx, lfo);
+  if (settings != 0) {
+    lfoStart(settings);
+  }
+  if (EFFECT_PTR(fx, sweep) != 0) {
+    sweep_state = SWEEP_IDLE;
+    sweep_position = 0;
+  }
+  if (EFFECT_BYTE(fx, flags) & FX_PATTERN) {
+    pattern_step = 0;
+    pattern_phase = 0;
+  }
+  setRouting(EFFECT_BYTE(fx, routing), (EFFECT_BYTE(fx, flags) & FX_DRY) ? no_dry_signal : LOW);
+}
+
+void chorusTick(void) {
+  // Sweep the delay times of both PT2399s in opposite directions.
+  if (engine_refresh or (digitalRead(PEDAL_SWITCH) != engine_pedal)) {
+    engine_pedal = digitalRead(PEDAL_SWITCH);
+    setRouting(EFFECT_BYTE(engine_effect, routing), !engine_pedal);
+  }
+  lfoSetRate(effect_state[engine_effect].counter);
+  unsigned int duty = lfoStep();
+  setDelaysHiRes(cvTime(duty), cvTime((440U << 8) - duty));
+}
+
+unsigned int sweepShape(unsigned long position) {
+  // Value of the shape at a position of the sweep, 0 ... 0xFFFF.
+  unsigned int x = position >> 16;
+  const byte *table = sweep_table[sweep_shape];
+  byte index = x >> 10;                 // 64 segments.
+  byte fraction = (x >> 2) & 0xFF;
+  unsigned int a = pgm_read_byte(&table[index]);
+  unsigned int b = pgm_read_byte(&table[index + 1]);
+  unsigned int value = (a << 8) + (int) (b - a) * fraction;
+  return value + (value >> 8);          // 0xFF00 ... 0xFFFF.
+}
+
+void sweepTick(void) {
+  // The decelerator and the accelerator: sweep the delay times while the pedal is held.
+  const SweepSettings *settings = (const SweepSettings *) EFFECT_PTR(engine_effect, sweep);
+  byte flags = pgm_read_byte(&settings->flags);
+  unsigned int start = (unsigned int) pgm_read_byte(&settings->start) << 8;
+  unsigned int counter_value = effect_state[engine_effect].counter;
+  byte depth_value = effect_state[engine_effect].depth;
+  long span = ((long) ((unsigned int) pgm_read_byte(&settings->end) << 8) - start) * depth_value / DEPTH_MAX;
+  unsigned int width = abs(span);
+  // counter ms per PWM duty step, the position covers the sweep in 2^32. Like lfoSetRate() the
+  // 32 bit division is only done when the counter, the depth or the effect has changed.
+  if (engine_refresh or (counter_value != sweep_counter) or (depth_value != sweep_depth)) {
+    sweep_counter = counter_value;
+    sweep_depth = depth_value;
+    unsigned long ticks = ((unsigned long) counter_value * width) >> 8;
+    sweep_rate = 0xFFFFFFFFUL / ((ticks > 0) ? ticks : 1);
+  }
+  unsigned long rate = sweep_rate;
+  bool pressed = digitalRead(PEDAL_SWITCH) == LOW; // We use a pullup, so when low it is pressed.
+  if (engine_refresh) {
+    setSwitches(LOW, LOW, LOW, LOW);
+  }
+  if ((sweep_state == SWEEP_IDLE) or (sweep_state == SWEEP_BACK)) {
+    if (pressed) {
+      // Go (again) from where the sweep is, with the wet signal on.
+      sweep_state = SWEEP_FORWARD;
+      setSwitches(LOW, HIGH, LOW, LOW);
+    }
+  } else if (pressed == false) {
+    if (flags & SWEEP_RETURN) {
+      // A muted sweep is heard again on its way back.
+      if (sweep_state == SWEEP_END) setSwitches(LOW, HIGH, LOW, LOW);
+      sweep_state = SWEEP_BACK;
+    } else {
+      sweep_state = SWEEP_IDLE;
+      sweep_position = 0;
+      setSwitches(LOW, LOW, LOW, LOW);
+    }
+  }
+  if (sweep_state == SWEEP_FORWARD) {
+    if (0xFFFFFFFFUL - sweep_position > rate) {
+      sweep_position += rate;
+    } else {
+      sweep_position = 0xFFFFFFFFUL;
+      sweep_state = SWEEP_END;
+      if (flags & SWEEP_MUTE) setSwitches(LOW, LOW, LOW, LOW);
+    }
+  } else if (sweep_state == SWEEP_BACK) {
+    unsigned long back = (rate > 0xFFFFFFFFUL / SWEEP_RETURN_SPEED) ? 0xFFFFFFFFUL : rate * SWEEP_RETURN_SPEED;
+    if (sweep_position > back) {
+      sweep_position -= back;
+    } else {
+      sweep_position = 0;
+      sweep_state = SWEEP_IDLE;
+      setSwitches(LOW, LOW, LOW, LOW);
+    }
+  }
+  // The width times the shape does not fit in a signed long, so it is scaled unsigned.
+  unsigned int offset = ((unsigned long) width * sweepShape(sweep_position)) >> 16;
+  unsigned int duty = (span < 0) ? start - offset : start + offset;
+  setDelaysHiRes(duty, duty);
+}
+
+void wowNotFlutterTick(void) {
+  // effect_state[WOW_NOT_FLUTTER].counter determines the speed of changing the delay time,
+  // the random walk waveform makes the changes irregular.
+  lfoSetRate(effect_state[WOW_NOT_FLUTTER].counter);
+  unsigned int duty = lfoStep() * 2;
+  setDelaysHiRes(duty, duty);
+}
+
+void psychoTick(void) {
+  if (engine_refresh or (no_dry_signal != engine_no_dry_signal)) {
+    engine_no_dry_signal = no_dry_signal;
+    setRouting(EFFECT_BYTE(PSYCHO, routing), no_dry_signal);
+  }
+  lfoSetRate(effect_state[PSYCHO].counter);
+  unsigned int psycho_duty = lfoStep();
+  setDelaysHiRes(((psycho_duty >> 1) > (50U << 8)) ? psycho_duty >> 1 : 50U << 8, (270U << 8) - psycho_duty);
+}
+
+void telegraphTick(void) {
+  // Switch the wet signal on with the pedal.
+  byte pedal = digitalRead(PEDAL_SWITCH);
+  if (engine_refresh or (pedal != engine_pedal)) {
+    engine_pedal = pedal;
+    //setSwitches(LOW, LOW, !digitalRead(PEDAL_SWITCH), LOW); // original
+    setSwitches(!pedal, LOW, HIGH, LOW);
+  }
+}
+
+void televerbTick(void) {
+  // Switch the reverbed signal on with the pedal.
+  byte pedal = digitalRead(PEDAL_SWITCH);
+  if (engine_refresh or (pedal != engine_pedal)) {
+    engine_pedal = pedal;
+    setRouting(pedal ? 0 : EFFECT_BYTE(TELEVERB, routing), !pedal);
+    setDelaysMatched(220U << 8, (unsigned int) (220 - (effect_state[REVERB].counter >> 1)) << 8);
+  }
+}
+
+unsigned int delayDuty(int fx) {
+  // The delay time of an effect as PWM duty (8 fractional bits): the tapped tempo or the counter.
+  if ((fx == tempo_effect) and (effect_state[fx].counter == tempo_counter)) return tempo_duty;
+  return effect_state[fx].counter * DUTY_PER_TIME_STEP;
+}
+
+void staticEffectTick(unsigned int delay_time1, unsigned int delay_time2) {
+  // Effects without modulation only need an update when their delay times (parameter or CV)
+  // or the dry setting change.
+  if (engine_refresh or (no_dry_signal != engine_no_dry_signal)) {
+    engine_no_dry_signal = no_dry_signal;
+    setRouting(EFFECT_BYTE(engine_effect, routing), no_dry_signal);
+  }
+  unsigned int duty1 = cvTime(delay_time1);
+  unsigned int duty2 = cvTime(delay_time2);
+  if (engine_refresh or (duty1 != engine_duty1) or (duty2 != engine_duty2)) {
+    engine_duty1 = duty1;
+    engine_duty2 = duty2;
+    setDelaysMatched(duty1, duty2);
+  }
+}
+
+void delayTick(void) {
+  // The short delay, delay and echo effects: both PT2399s at the effect's delay time.
+  unsigned int duty = delayDuty(engine_effect);
+  staticEffectTick(duty, duty);
+}
+
+void duckTick(void) {
+  // An echo whose wet signal (SWB and SWD) is switched off while the input is loud and switched
+  // on again in the gaps, so the echoes do not clutter what is being played.
+  unsigned int level = envelope; // The ADC interrupt can not interrupt this one.
+  if (level >= DUCK_ON_LEVEL) {
+    duck_hold = DUCK_HOLD_TICKS;
+  } else if ((duck_hold > 0) and (level < DUCK_OFF_LEVEL)) {
+    duck_hold--;
+  }
+  bool ducked = (duck_hold > 0);
+  bool update = engine_refresh or (no_dry_signal != engine_no_dry_signal) or (ducked != engine_ducked);
+  unsigned int duty = delayDuty(engine_effect);
+  staticEffectTick(duty, duty);
+  if (update) {
+    engine_ducked = ducked;
+    byte routing = EFFECT_BYTE(engine_effect, routing);
+    setRouting(ducked ? routing & ~(ROUTE_B | ROUTE_D) : routing, no_dry_signal);
+  }
+}
+
+unsigned int patternDuty(byte board, byte time, unsigned int bpm) {
+  // PWM duty (8 fractional bits) of a board for a delay time of time PATTERN_UNITS of a beat.
+  unsigned int ms = (unsigned long) time * 60000UL / ((unsigned long) PATTERN_UNITS * bpm);
+  unsigned int duty = dutyForDelayTime(board, ms);
+  if (duty < (1 << 8)) duty = 1 << 8;
+  if (duty > ((unsigned int) MAX_COUNTER << 8)) duty = (unsigned int) MAX_COUNTER << 8;
+  return duty;
+}
+
+void patternTick(void) {
+  // Advance the pattern by one control tick. A new step sets the delay times of both boards
+  // (each with its own calibration) and the taps which are heard.
+  unsigned int bpm = effect_state[engine_effect].counter;
+  byte number = pattern_number;
+  const PatternStep *steps = (const PatternStep *) pgm_read_ptr(&patterns[number]);
+  bool update = engine_refresh or (bpm != engine_bpm) or (no_dry_signal != engine_no_dry_signal);
+  if (number != engine_pattern) {
+    engine_pattern = number;
+    pattern_step = 0;
+    pattern_phase = 0;
+    update = true;
+  }
+  pattern_phase += (unsigned long) PATTERN_UNITS * bpm;
+  unsigned long step_end = pgm_read_byte(&steps[pattern_step].length) * PATTERN_PHASE_PER_UNIT;
+  if (pattern_phase >= step_end) {
+    pattern_phase -= step_end;
+    pattern_step++;
+    if (pgm_read_byte(&steps[pattern_step].length) == 0) pattern_step = 0;
+    update = true;
+  }
+  if (update) {
+    const PatternStep *step = &steps[pattern_step];
+    engine_bpm = bpm;
+    engine_no_dry_signal = no_dry_signal;
+    pattern_duty1 = patternDuty(BOARD1, pgm_read_byte(&step->time1), bpm);
+    pattern_duty2 = patternDuty(BOARD2, pgm_read_byte(&step->time2), bpm);
+    setRouting(pgm_read_byte(&step->routing), no_dry_signal);
+  }
+  setDelaysHiRes(cvTime(pattern_duty1), cvTime(pattern_duty2));
+}
+
+void reverbTick(void) {
+  // One delay is 1/2 the other.
+  staticEffectTick((unsigned int) MAX_COUNTER << 8, (unsigned int) (MAX_COUNTER - (effect_state[REVERB].counter >> 1)) << 8);
+}
+
+void tapTempoUpdate(void) {
+  // Set the delay and echo effects to the tapped or clocked tempo when a new interval came in.
+  unsigned long sum = 0;
+  byte count = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (tap_new == true) {
+      tap_new = false;
+      count = tap_count;
+      for (byte i = 0; i < count; i++) {
+        sum += tap_intervals[(tap_index - 1 - i) & (TAP_AVERAGE - 1)];
+      }
+    }
+  }
+  if (count == 0) return;
+  if ((EFFECT_BYTE(effect, flags) & FX_TAP) == 0) return;
+  byte chips = EFFECT_BYTE(effect, value_base); // PT2399s in series.
+  unsigned long beat_us = sum / count;
+  if (EFFECT_BYTE(effect, flags) & FX_PATTERN) {
+    // The pattern engine takes the tempo itself.
+    unsigned long bpm = 60000000UL / beat_us;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      effect_state[effect].counter = constrain(bpm, (unsigned long) PATTERN_BPM_MIN, (unsigned long) PATTERN_BPM_MAX);
+    }
+    return;
+  }
+  // Pick the longest subdivision of the beat one PT2399 can do.
+  unsigned int shortest = delayTimeMs(BOARD1, (unsigned int) MAX_COUNTER << 8);
+  unsigned int longest = delayTimeMs(BOARD1, 1 << 8);
+  if (shortest > longest) {
+    unsigned int swap = shortest;
+    shortest = longest;
+    longest = swap;
+  }
+  unsigned long ms = 0;
+  for (byte i = 0; i < NR_OF_SUBDIVISIONS; i++) {
+    ms = beat_us * pgm_read_byte(&subdivisions[i].beats) / pgm_read_byte(&subdivisions[i].per) / (1000UL * chips);
+    if (ms <= longest) break;
+  }
+  unsigned int duty = dutyForDelayTime(BOARD1, ms);
+  if (duty < (1 << 8)) duty = 1 << 8;
+  if (duty > ((unsigned int) MAX_COUNTER << 8)) duty = (unsigned int) MAX_COUNTER << 8;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    tempo_duty = duty;
+    tempo_effect = effect;
+    tempo_counter = (duty + DUTY_PER_TIME_STEP / 2) / DUTY_PER_TIME_STEP; // The nearest counter value is shown and saved.
+    effect_state[effect].counter = tempo_counter;
+  }
+}
+
+void controlTick(void) {
+  // Runs CONTROL_RATE_HZ times per second from the control timer (Timer2 on the nano).
+  cvUpdate(); // Also while held, the self test measures the CV.
+  if (engine_hold == true) {
+    engine_effect = -1; // Start the effect afresh when the UI task hands back control.
+    transition_ticks = 0;
+    return;
+  }
+  int fx = effect;
+  if (fx != engine_effect) {
+    if (engine_effect >= 0) {
+      // Glide from here, with only the dry signal on.
+      transition_duty1 = output_duty1;
+      transition_duty2 = output_duty2;
+      transition_ticks = TRANSITION_TICKS;
+      writeRoutingNow(ROUTE_C);
+    }
+    engine_effect = fx;
+    enterEffect(fx);
+  }
+  void (*tick)(void) = (void (*)(void)) EFFECT_PTR(fx, tick);
+  tick();
+  engine_refresh = false;
+  if (transition_ticks > 0) {
+    transition_ticks--;
+    // Linear glide towards what the effect asks for, which may be moving itself.
+    writeDelays(effect_duty1 + ((long) transition_duty1 - effect_duty1) * transition_ticks / TRANSITION_TICKS,
+                effect_duty2 + ((long) transition_duty2 - effect_duty2) * transition_ticks / TRANSITION_TICKS);
+    if (transition_ticks == 0) {
+      writeRoutingNow(effect_routing);
+    }
+  }
+}
+
+void controlInterrupt(void) {
+  // The interrupt of the control rate timer.
+  PROFILE_START(control);
+  #ifdef PROFILE
+    static unsigned long last_tick = 0;
+    long deviation = (long) (profile_control - last_tick) - 1000000L / CONTROL_RATE_HZ;
+    if (last_tick != 0) profileRecord(PROF_JITTER, (deviation < 0) ? -deviation : deviation);
+    last_tick = profile_control;
+  #endif
+  if ((led_ticks > 0) and (--led_ticks == 0)) {
+    toggleLed13();
+  }
+  controlTick();
+  PROFILE_END(control, PROF_CONTROL);
+}
+
+#ifdef HAL_RP2040
+volatile bool hal_engine_start = false; // Set by setup() when the engine may start its timer.
+repeating_timer_t hal_control_timer;
+
+bool halControlTimer(repeating_timer_t *timer) {
+  // The callback of the engine's alarm pool, it takes the lock for the whole tick.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    #if defined(CV_INPUT) or defined(ENVELOPE_INPUT)
+      halSampleInputs();
+    #endif
+    controlInterrupt();
+  }
+  return true;
+}
+
+void setupControlTimer(void) {
+  // HAL: the timer is started by setup1(), see there.
+  hal_engine_start = true;
+}
+
+void setup1() {
+  // The second core runs nothing but the control rate engine. The default alarm pool belongs to
+  // the first core, so the engine gets a pool of its own: its alarm interrupt is enabled on the
+  // core which creates the pool, this one.
+  while (hal_engine_start == false) {
+  }
+  alarm_pool_t *pool = alarm_pool_create_with_unused_hardware_alarm(1);
+  // A negative period is from the start of one tick to the next, so the rate does not drift.
+  alarm_pool_add_repeating_timer_us(pool, -1000000L / CONTROL_RATE_HZ, halControlTimer, NULL, &hal_control_timer);
+}
+
+void loop1() {
+  __wfi();
+}
+#else
+ISR(TIMER2_COMPA_vect) {
+  controlInterrupt();
+}
+
+void setupControlTimer(void) {
+  // HAL: Timer2 in CTC mode interrupts CONTROL_RATE_HZ times per second.
+  noInterrupts();
+  TCCR2A = (1 << WGM21);              // CTC mode, TOP = OCR2A.
+  TCCR2B = (1 << CS22) | (1 << CS20); // clk/128.
+  OCR2A = CONTROL_TIMER_TOP;
+  TCNT2 = 0;
+  TIMSK2 = (1 << OCIE2A);
+  interrupts();
+}
+#endif
+
+void warpTick(void) {
+  // Draw the next circle of the time warp, once the previous one has been sent.
+  if (displayDirty()) return;
+  display.fillCircle(display.width() / 2, display.height() / 2, warp_radius, (warp_step == WARP_CIRCLES1) ? SSD1306_INVERSE : SSD1306_BLACK);
+  markDisplayDirty(display.width() / 2 - warp_radius, display.height() / 2 - warp_radius, 2 * warp_radius + 1, 2 * warp_radius + 1);
+  warp_radius += 3;
+  if (warp_radius < DISPLAY_WIDTH / 2) return;
+  warp_radius = 0;
+  warp_step = (warp_step == WARP_CIRCLES1) ? WARP_CIRCLES2 : WARP_IDLE;
+}
+
+bool splashTick(void) {
+  // Draws the next step of the splash screen when its time has come, returns false when the
+  // splash screen is done. Called from the UI task, the effect is already running.
+  static byte step = 0;
+  static unsigned long next_time = 0;
+  static int16_t radius = 0;
+  if (millis() < next_time) return true;
+  display.setTextSize(2); // Normal 2:1 pixel scale
+  switch (step) {
+    case SPLASH_TIME:
+      displayClear();
+      displayText(F("Time"), 0, 1, 4);
+      next_time = millis() + 600;
+      break;
+    case SPLASH_WARP:
+      displayClear();
+      displayText(F("Warp"), 0, 1, 4);
+      next_time = millis() + 600;
+      break;
+    case SPLASH_O:
+      displayClear();
+      displayText(F("-O-"), 0, 1, 5);
+      next_time = millis() + 600;
+      radius = 0;
+      break;
+    case SPLASH_CIRCLES1:
+    case SPLASH_CIRCLES2:
+      // One circle per step, the INVERSE color is used so circles alternate white/black.
+      if (display_ready == true) {
+        display.fillCircle(display.width() / 2, display.height() / 2, radius, (step == SPLASH_CIRCLES1) ? SSD1306_INVERSE : SSD1306_BLACK);
+        markDisplayDirty(display.width() / 2 - radius, display.height() / 2 - radius, 2 * radius + 1, 2 * radius + 1);
+      }
+      radius += 3;
+      next_time = millis() + 1;
+      if (radius < DISPLAY_WIDTH / 2) return true; // Stay in this step.
+      radius = 0;
+      if (step == SPLASH_CIRCLES2) next_time = millis() + 200;
+      break;
+    case SPLASH_MATIC:
+      displayClear();
+      displayText(F("Matic"), 0, 1, 3);
+      next_time = millis() + 600;
+      break;
+    case SPLASH_VERSION:
+      displayText(FSTR(pgm_version), 7, 1, 3, CLEAR_LOCAL, 2);
+      next_time = millis() + 1200;
+      break;
+    default:
+      displayClear();
+      return false;
+  }
+  step++;
+  return true;
+}
+
+void setupDisplay() {
+  // SSD1306_SWITCHCAPVCC = generate display voltage from 3.3V internally
+  // Without a display the Time-Warp-O-Matic works as well, so do not wait for it.
+  display_ready = display.begin(SSD1306_SWITCHCAPVCC, OLED_ADDRESS);
+  if (display_ready == false) {
+    #ifdef DEBUG
+      Serial.println(F("SSD1306 allocation failed."));
+    #endif
+    return;
+  }
+  #ifdef DEBUG
+    Serial.println(F("SSD1306 allocation succeeded!"));
+  #endif
+  display.clearDisplay();  
+  // Nothing is known about what the display RAM holds, so the first flush sends all pages.
+  displayInvalidate();
+  display.setTextSize(2);  // Normal 2:1 pixel scale
+}
+
+void debugMode(void) {  
+  
+  // This function will run continuously as soon as the 
+  // jumper is bridged on the PCB, connecting D12 to GND.
+  display.setTextSize(1);
+  
+  delay_variable += 10 * (UI_PERIOD_MS / 10); // About the same pace as when it was run every 10 ms.
+  if (delay_variable > 4000) delay_variable = 0;
+  
+  // Show delay variable on display
+  textNumber(textAppend(text_buffer, F("DV:")), delay_variable, 4, '0');
+  displayText(text_buffer, 7, 1, 0, CLEAR_LOCAL, 1);
+
+  textNumber(textAppend(text_buffer, F("Rot. delay  ")), effect_state[effect].counter);
+  displayText(text_buffer, 15, 2, 0, CLEAR_LOCAL, 1);
+  textNumber(textAppend(text_buffer, F("Rot. effect ")), effect);
+  displayText(text_buffer, 13, 3, 0, CLEAR_LOCAL, 1);
+  textNumber(textAppend(text_buffer, F("Tap ")), digitalRead(PEDAL_SWITCH));
+  displayText(text_buffer, 5, 4, 0, CLEAR_LOCAL);
+  
+  if (delay_variable < 2000) {
+    setDelays(delay_variable >> 3, delay_variable >> 3); // Every 2s.
+  } else {
+    setDelays(255 - ((delay_variable - 2000) >> 3), 255 - ((delay_variable - 2000) >> 3)); // Every 2s.
+  }
+  #ifdef DEBUG  
+    Serial.print(F("Tap Detect: "));
     Serial.println(!digitalRead(PEDAL_SWITCH));
   #endif  
   if (digitalRead(PEDAL_SWITCH) == LOW) { // We use a pullup, so when low it is pressed.
-    displayText("TP prssd", 12, 1, 7, CLEAR_LINE);
+    displayText(F("TP prssd"), 12, 1, 7, CLEAR_LINE);
     if (delay_variable < 2000)
       setSwitches(LOW, LOW, LOW, LOW);     // OFF
     else  
       setSwitches(HIGH, HIGH, HIGH, HIGH); // ON
   }
   if (digitalRead(PEDAL_SWITCH) == HIGH) { // We use a pullup, so when high it is not pressed.
-    displayText("TP NT prssd", 0, 1, 6, CLEAR_LINE);
+    displayText(F("TP NT prssd"), 0, 1, 6, CLEAR_LINE);
     if (delay_variable < 1000)
       setSwitches(LOW, LOW, LOW, LOW);     // OFF
     else if (delay_variable < 2000)
@@ -597,35 +3004,719 @@ void debugMode(void) {
       setSwitches(HIGH, HIGH, HIGH, HIGH); // ON
   }
   showSwitchStatus();
-  button.tick();
 }
 
-void cls(Timer* timer){
-  int action = timer->getAction();
-  switch(action) {
-    case CLS_TIMER_ACTION: 
-      display.clearDisplay();
-      display.display();
-      screen_saver = ON;
+void selfTestStart(void) {
+  selftest_phase = SELFTEST_PWM;
+  selftest_step = 0;
+  selftest_applied = false;
+  selftest_pedal_down = false;
+  for (byte i = 0; i < NR_OF_RESULTS; i++) {
+    selftest_result[i] = TEST_PASS;
+  }
+  self_testing = true;
+}
+
+void selfTestNextPhase(void) {
+  selftest_phase++;
+  selftest_step = 0;
+  selftest_applied = false;
+}
+
+byte selfTestRouting(byte step) {
+  // A single switch at a time, with all off before and all on after.
+  switch (step) {
+    case 1:  return ROUTE_A;
+    case 2:  return ROUTE_B;
+    case 3:  return ROUTE_C;
+    case 4:  return ROUTE_D;
+    case 5:  return ROUTE_MASK;
+    default: return 0;
+  }
+}
+
+void selfTestCheckPwm(unsigned int duty) {
+  // The compare registers must hold what was asked for, and at 0 and 255 the outputs are
+  // constantly low or high, so any other level means a short on the pin.
+  #ifdef HIRES_PWM
+    unsigned int compare = dutyToCompareValue(duty);
+    if ((halReadPwm(BOARD1) != compare) or (halReadPwm(BOARD2) != compare)) selftest_result[RESULT_PWM] = TEST_FAIL;
+  #endif
+  unsigned long pins = halReadPwmPins();
+  if ((duty == 0) and (pins != 0)) selftest_result[RESULT_PWM] = TEST_FAIL;
+  if ((duty >= (255U << 8)) and (pins != DELAY_PINS)) selftest_result[RESULT_PWM] = TEST_FAIL;
+  selftest_cv[selftest_step] = cv_value;
+}
+
+void selfTestCheckCv(void) {
+  // Wired to the filtered PWM of board 1 the CV rises with every duty step.
+  if (selftest_cv[SELFTEST_PWM_STEPS - 1] < SELFTEST_CV_MIN) {
+    selftest_result[RESULT_CV] = TEST_SKIPPED;
+    return;
+  }
+  for (byte i = 1; i < SELFTEST_PWM_STEPS; i++) {
+    if (selftest_cv[i] <= selftest_cv[i - 1]) selftest_result[RESULT_CV] = TEST_FAIL;
+  }
+}
+
+unsigned int selfTestResults(void) {
+  // The results with 2 bits each, RESULT_PWM in bits 0 and 1.
+  unsigned int value = 0;
+  for (byte i = 0; i < NR_OF_RESULTS; i++) {
+    value |= (unsigned int) selftest_result[i] << (2 * i);
+  }
+  return value;
+}
+
+void remoteSend(byte command, unsigned int value);
+
+void selfTestReport(void) {
+  // The results go out as a remote control frame, so the production build reports them without
+  // text between the replies. The port is the MIDI input with MIDI_REMOTE, so nothing is sent.
+  #ifndef MIDI_REMOTE
+    remoteSend(REMOTE_SELFTEST, selfTestResults());
+  #endif
+  #ifdef DEBUG
+    const char *const names[NR_OF_RESULTS] = { PSTR("PWM "), PSTR("Switch "), PSTR("Pedal "), PSTR("CV ") };
+    Serial.println(F("Self test:"));
+    for (byte i = 0; i < NR_OF_RESULTS; i++) {
+      Serial.print(FSTR(names[i]));
+      if (selftest_result[i] == TEST_PASS) Serial.println(F("pass"));
+      else if (selftest_result[i] == TEST_FAIL) Serial.println(F("FAIL"));
+      else Serial.println(F("not tested"));
+    }
+  #endif
+}
+
+char *textResult(char *text, const __FlashStringHelper *name, byte result) {
+  text = textAppend(text, name);
+  if (result == TEST_PASS) return textAppend(text, F("ok "));
+  if (result == TEST_FAIL) return textAppend(text, F("FAIL "));
+  return textAppend(text, F("n.c. "));
+}
+
+void selfTestMode(void) {
+  // One step of the self test per call, the outputs are set at the start of a step and
+  // checked at its end.
+  unsigned long now = millis();
+  display.setTextSize(1);
+  switch (selftest_phase) {
+    case SELFTEST_PWM: {
+      unsigned int duty = pgm_read_word(&selftest_duties[selftest_step]);
+      if (selftest_applied == false) {
+        setSwitches(HIGH, LOW, HIGH, HIGH); // Both boards and the dry signal.
+        setDelaysHiRes(duty, duty);
+        selftest_applied = true;
+        selftest_time = now;
+        textNumber(textAppend(text_buffer, F("Test PWM duty ")), duty >> 8);
+        displayText(text_buffer, 21, 0, 0, CLEAR_LINE, 1);
+      } else if (now - selftest_time >= SELFTEST_STEP_MS) {
+        selfTestCheckPwm(duty);
+        selftest_applied = false;
+        if (++selftest_step == SELFTEST_PWM_STEPS) {
+          selfTestCheckCv();
+          selfTestNextPhase();
+        }
+      }
+      break;
+    }
+    case SELFTEST_SWITCHES: {
+      byte routing = selfTestRouting(selftest_step);
+      if (selftest_applied == false) {
+        writeRouting(routing);
+        selftest_applied = true;
+        selftest_time = now;
+        textNumber(textAppend(text_buffer, F("Test switches ")), selftest_step + 1);
+        displayText(text_buffer, 21, 0, 0, CLEAR_LINE, 1);
+        showSwitchStatus();
+      } else if (now - selftest_time >= SELFTEST_STEP_MS) {
+        // An output pin reads back what it drives, unless it is shorted.
+        if (halReadRouting() != routing) selftest_result[RESULT_SWITCH] = TEST_FAIL;
+        selftest_applied = false;
+        if (++selftest_step == SELFTEST_SWITCH_STEPS) selfTestNextPhase();
+      }
       break;
-    case SCREENSAVER_TIMER_ACTION:
+    }
+    case SELFTEST_PEDAL:
+      if (selftest_applied == false) {
+        setSwitches(LOW, LOW, HIGH, LOW);
+        selftest_applied = true;
+        selftest_time = now;
+        displayText(F("Press the pedal"), 21, 0, 0, CLEAR_LINE, 1);
+      }
+      if (digitalRead(PEDAL_SWITCH) == LOW) {
+        selftest_pedal_down = true;
+      } else if (selftest_pedal_down == true) {
+        selfTestNextPhase(); // Pressed and released.
+      } else if (now - selftest_time >= SELFTEST_PEDAL_MS) {
+        selftest_result[RESULT_PEDAL] = TEST_FAIL;
+        selfTestNextPhase();
+      }
+      if (selftest_phase == SELFTEST_DONE) {
+        selfTestReport();
+        char *text = textResult(text_buffer, F("PWM "), selftest_result[RESULT_PWM]);
+        textResult(text, F("Switch "), selftest_result[RESULT_SWITCH]);
+        displayText(text_buffer, 21, 1, 0, CLEAR_LINE, 1);
+        text = textResult(text_buffer, F("Pedal "), selftest_result[RESULT_PEDAL]);
+        textResult(text, F("CV "), selftest_result[RESULT_CV]);
+        displayText(text_buffer, 21, 2, 0, CLEAR_LINE, 1);
+        displayText(F("Self test done"), 21, 0, 0, CLEAR_LINE, 1);
+        displayText(F("Press to leave"), 21, 3, 0, CLEAR_LINE, 1);
+      }
+      break;
+    default:
+      break;
+  }
+  display.setTextSize(2);
+}
+
+void menuMode(void) {
+  // The long press menu: recall or store a preset, or calibrate the delay times. The effect
+  // keeps running in the mean time.
+  byte item = menu_item;
+  display.setTextSize(1);
+  displayText(F("Menu"), 16, 0, 0, CLEAR_LINE, 1);
+  display.setTextSize(2);
+  if (item < MENU_STORE) {
+    textNumber(textAppend(text_buffer, F("Recall ")), item - MENU_RECALL + 1);
+  } else if (item < MENU_CALIBRATE) {
+    textNumber(textAppend(text_buffer, F("Store ")), item - MENU_STORE + 1);
+  } else if (item == MENU_CALIBRATE) {
+    textAppend(text_buffer, F("Calibrate"));
+  } else if (item == MENU_SELFTEST) {
+    textAppend(text_buffer, F("Self test"));
+  } else if (item == MENU_BYPASS) {
+    textAppend(text_buffer, (settings_options & OPTION_DELAYED_BYPASS) ? F("Bypass 2s") : F("Bypass now"));
+  } else if (item == MENU_STAGE) {
+    textAppend(text_buffer, (settings_options & OPTION_STAGE) ? F("Stage on") : F("Stage off"));
+  } else {
+    textAppend(text_buffer, F("Exit"));
+  }
+  displayText(text_buffer, 0, 1, 0, CLEAR_LINE, 2);
+  if (menu_chosen == false) return;
+  // Recalling and storing a preset wait for the EEPROM, so while it is still writing (up to
+  // about 0.5 s after a store) they are carried out on a later run, as remoteUpdate() does.
+  if ((item < MENU_CALIBRATE) and eepromBusy()) return;
+  menu_chosen = false;
+  display.setTextSize(1);
+  if (item < MENU_STORE) {
+    if (recallPreset(item - MENU_RECALL)) {
+      menu_active = false;
+    } else {
+      displayText(F("Empty"), 0, 3, 0, CLEAR_LINE, 1);
+    }
+  } else if (item < MENU_CALIBRATE) {
+    storePreset(item - MENU_STORE);
+    menu_active = false;
+  } else if (item == MENU_CALIBRATE) {
+    calibration_point = 0;
+    calibration_result = CALIBRATION_BUSY;
+    menu_active = false;
+    calibrating = true;
+  } else if (item == MENU_SELFTEST) {
+    selfTestStart();
+    menu_active = false;
+  } else if (item == MENU_BYPASS) {
+    settings_options ^= OPTION_DELAYED_BYPASS; // The menu stays open and shows the new setting.
+    updateEepromTimer();
+  } else if (item == MENU_STAGE) {
+    settings_options ^= OPTION_STAGE;
+    updateEepromTimer();
+  } else {
+    menu_active = false;
+  }
+  display.setTextSize(2);
+}
+
+void calibrationMode(void) {
+  // Drive one board at the PWM duty of the current calibration point, with the dry signal
+  // on as well, so the time between the dry signal and its echo can be measured, e.g. with
+  // a scope or a click recorded in a DAW. The rotary encoder sets the measured time,
+  // a click moves on to the next point.
+  byte board = calibration_point / CALIBRATION_POINTS;
+  byte point = calibration_point % CALIBRATION_POINTS;
+  unsigned long duty = ((unsigned long) point * CALIBRATION_SPACING) << 8;
+  if (duty > 0xFFFF) duty = 0xFFFF;
+  if (board == BOARD1) {
+    setSwitches(HIGH, LOW, HIGH, LOW); // Routing of SHORT_DELAY1.
+  } else {
+    setSwitches(LOW, LOW, HIGH, HIGH); // Routing of SHORT_DELAY2.
+  }
+  setDelaysHiRes(duty, duty);
+
+  display.setTextSize(1);
+  textNumber(textAppend(text_buffer, F("Cal. board ")), board + 1);
+  displayText(text_buffer, 16, 0, 0, CLEAR_LINE, 1);
+  char *text = textNumber(textAppend(text_buffer, F("Duty ")), point * CALIBRATION_SPACING, 3);
+  text = textNumber(textAppend(text, F("  P")), point + 1);
+  textNumber(textAppend(text, F("/")), CALIBRATION_POINTS);
+  displayText(text_buffer, 16, 1, 0, CLEAR_LINE, 1);
+  display.setTextSize(2);
+  textAppend(textNumber(text_buffer, calibration[board][point] * CALIBRATION_MS_PER_UNIT, 3), F("ms"));
+  displayText(text_buffer, 0, 2, 0, CLEAR_LINE, 2);
+}
+
+void screensaverTask(void) {
+  // Dim the display after SCREEN_DIM_TIMEOUT without a rotation or a press, clear it after
+  // SCREEN_TIMEOUT and start a time warp every SCREENSAVER_TIMEOUT while it is cleared. With
+  // Stage on the display is switched off after STAGE_TIMEOUT, so the I2C bus stays quiet while
+  // you play. Any activity wakes the display.
+  unsigned long now = millis();
+  if (user_activity == true) {
+    user_activity = false;
+    last_activity = now;
+    displayPower(DISPLAY_ON);
     if (screen_saver == ON) {
-      showFillCircle1();
-      showFillCircle2();
+      screen_saver = OFF;
+      warp_step = WARP_IDLE;
+      displayClear();
+      loopb = true;
+      old_no_dry_signal = !no_dry_signal;
     }
+    return;
+  }
+  unsigned long idle = now - last_activity;
+  if ((settings_options & OPTION_STAGE) and (idle >= STAGE_TIMEOUT)) {
+    displayPower(DISPLAY_OFF);
+  } else if (idle >= SCREEN_DIM_TIMEOUT) {
+    displayPower(DISPLAY_DIM);
+  }
+  if (screen_saver == OFF) {
+    if (idle >= SCREEN_TIMEOUT) {
+      displayClear();
+      screen_saver = ON;
+      next_warp = now + SCREENSAVER_TIMEOUT;
+      warps_shown = 0;
+    }
+  } else if (((long) (now - next_warp) >= 0) and (warps_shown < SCREENSAVER_REPETITION)) {
+    next_warp += SCREENSAVER_TIMEOUT;
+    warps_shown++;
+    // The UI task draws it, frame by frame.
+    if ((display_ready == true) and (display_power != DISPLAY_OFF)) {
+      warp_radius = 0;
+      warp_step = WARP_CIRCLES1;
+    }
+  }
+}
+
+void bypassUpdate(void) {
+  // Take over the level of the bypass switch once it has been stable for BYPASS_DEBOUNCE_MS.
+  unsigned long edge;
+  byte pin;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    edge = bypass_edge_ms;
+    pin = bypass_pin;
+  }
+  bool level = (pin == LOW); // We use a pullup, so when low it is bypassed.
+  if ((level != bypassed) and (millis() - edge >= BYPASS_DEBOUNCE_MS)) {
+    bypassed = level;
+    bypass_since = millis();
+  }
+}
+
+void controlTask(void) {
+  // Decide which mode the pedal is in. In debug, bypass and calibration mode the UI task sets
+  // the switches and delays itself, so the engine is held.
+  bypassUpdate();
+  byte mode = MODE_NORMAL;
+  if (digitalRead(DEBUG_JUMPER) == LOW) {
+    mode = MODE_DEBUG;
+  } else if (bypassed == true) {
+    mode = MODE_BYPASS;
+  } else if (self_testing == true) {
+    mode = MODE_SELFTEST;
+  } else if (calibrating == true) {
+    mode = MODE_CALIBRATION;
+  } else if (menu_active == true) {
+    mode = MODE_MENU;
+  } else if (splash_active == true) {
+    mode = MODE_SPLASH;
+  }
+  bool delayed = (mode == MODE_BYPASS) and (settings_options & OPTION_DELAYED_BYPASS) and (millis() - bypass_since < BYPASS_DELAY_MS);
+  bool hold = (mode == MODE_DEBUG) or ((mode == MODE_BYPASS) and (delayed == false)) or (mode == MODE_CALIBRATION) or (mode == MODE_SELFTEST);
+  if ((mode == MODE_BYPASS) and (hold == true)) {
+    if (bypass_switched == false) {
+      // Going into bypass mode: hold the engine and pass only the dry signal, once. To hear
+      // anything the W/D potentiometer should be turned to W.
+      engine_hold = true;
+      writeRoutingNow(ROUTE_C);
+      bypass_switched = true;
+    }
+  } else {
+    bypass_switched = false;
+  }
+  engine_hold = hold;
+  ui_mode = mode;
+  effect_status = (mode == MODE_BYPASS) ? LOW : HIGH;
+
+  if (calibration_result != CALIBRATION_BUSY) {
+    if (calibration_result == CALIBRATION_SAVE) {
+      writeCalibrationToEeprom();
+    } else {
+      readCalibrationFromEeprom();
+    }
+    calibration_result = CALIBRATION_BUSY;
+  }
+  tapTempoUpdate();
+}
+
+unsigned int remoteApply(byte command, unsigned int value) {
+  // Carry out a command, return the value in use afterwards.
+  unsigned int result = value;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    switch (command) {
+      case REMOTE_EFFECT:
+        if (value < NR_OF_EFFECTS) effect = value;
+        pageCheck();
+        result = effect;
+        break;
+      case REMOTE_COUNTER:
+        effect_state[effect].counter = constrain(value, EFFECT_WORD(effect, counter_min), EFFECT_WORD(effect, counter_max));
+        result = effect_state[effect].counter;
+        break;
+      case REMOTE_DEPTH:
+        effect_state[effect].depth = (value > DEPTH_MAX) ? DEPTH_MAX : value;
+        result = effect_state[effect].depth;
+        break;
+      case REMOTE_CV:
+        if (pageAvailable(effect, PAGE_CV) and (value <= cvLast(effect))) effect_state[effect].cv_route = value;
+        result = effect_state[effect].cv_route;
+        break;
+      case REMOTE_DRY:
+        if (EFFECT_BYTE(effect, flags) & FX_DRY) no_dry_signal = (value != 0);
+        result = no_dry_signal;
+        break;
+      case REMOTE_SELFTEST:
+        return selfTestResults();
+      case REMOTE_RECALL:
+      case REMOTE_STORE:
+        // Done by remoteUpdate() when the EEPROM is not busy, so the input task never waits.
+        if (value < NR_OF_PRESETS) {
+          remote_preset = value;
+          remote_store = (command == REMOTE_STORE);
+        }
+        return value;
+      default:
+        return 0;
+    }
+  }
+  // Redraw and save like after a turn of the encoder.
+  loopb = true;
+  old_no_dry_signal = !no_dry_signal;
+  updateEepromTimer();
+  return result;
+}
+
+void remoteSend(byte command, unsigned int value) {
+  // A frame is written at once, so a task can not send one in the middle of another.
+  byte reply[REMOTE_FRAME_SIZE] = { REMOTE_SYNC, (byte) (command | 0x80), (byte) value, (byte) (value >> 8), 0 };
+  reply[4] = reply[1] ^ reply[2] ^ reply[3];
+  Serial.write(reply, REMOTE_FRAME_SIZE);
+}
+
+void remoteByte(byte data) {
+  if (remote_length == 0) {
+    if (data == REMOTE_SYNC) {
+      remote_frame[remote_length++] = data;
+    }
+    #ifdef PROFILE
+      else profileCommand(data);
+    #endif
+    return;
+  }
+  remote_frame[remote_length++] = data;
+  if (remote_length < REMOTE_FRAME_SIZE) return;
+  remote_length = 0;
+  byte command = remote_frame[1];
+  if ((command ^ remote_frame[2] ^ remote_frame[3]) != remote_frame[4]) return;
+  remoteSend(command, remoteApply(command, remote_frame[2] | ((unsigned int) remote_frame[3] << 8)));
+}
+
+void midiControl(byte controller, byte value) {
+  switch (controller) {
+    case MIDI_CC_EFFECT:
+      remoteApply(REMOTE_EFFECT, value);
+      break;
+    case MIDI_CC_COUNTER: {
+      unsigned int low = EFFECT_WORD(effect, counter_min);
+      remoteApply(REMOTE_COUNTER, low + (unsigned long) (EFFECT_WORD(effect, counter_max) - low) * value / 127);
+      break;
+    }
+    case MIDI_CC_DEPTH:
+      remoteApply(REMOTE_DEPTH, (unsigned int) value * DEPTH_MAX / 127);
+      break;
+    case MIDI_CC_CV:
+      remoteApply(REMOTE_CV, value >> 5);
+      break;
+    case MIDI_CC_DRY:
+      remoteApply(REMOTE_DRY, value >= 64);
+      break;
+  }
+}
+
+void midiByte(byte data) {
+  // A small MIDI parser with running status, only Program Change and Control Change are used.
+  if (data >= 0xF8) return;  // Real time messages may come in between.
+  if (data >= 0x80) {
+    midi_status = (data < 0xF0) ? data : 0; // System messages cancel the running status.
+    midi_count = 0;
+    return;
+  }
+  if (midi_status == 0) return;
+  byte type = midi_status & 0xF0;
+  byte length = ((type == 0xC0) or (type == 0xD0)) ? 1 : 2;
+  if (++midi_count < length) {
+    midi_controller = data;
+    return;
+  }
+  midi_count = 0;
+  if ((MIDI_CHANNEL != 0) and ((midi_status & 0x0F) != MIDI_CHANNEL - 1)) return;
+  if (type == 0xC0) {
+    remoteApply(REMOTE_RECALL, data);
+  } else if (type == 0xB0) {
+    midiControl(midi_controller, data);
+  }
+}
+
+void remoteUpdate(void) {
+  for (byte i = 0; (i < REMOTE_BYTES_PER_RUN) and (Serial.available() > 0); i++) {
+    #ifdef MIDI_REMOTE
+      midiByte(Serial.read());
+    #else
+      remoteByte(Serial.read());
+    #endif
+  }
+  if ((remote_preset >= 0) and (eepromBusy() == false)) {
+    if (remote_store == true) {
+      storePreset(remote_preset);
+    } else {
+      recallPreset(remote_preset);
+    }
+    remote_preset = -1;
+    loopb = true;
+    old_no_dry_signal = !no_dry_signal;
+  }
+}
+
+void inputTask(void) {
+  // Handle the encoder steps and button edges the interrupts have queued. The button is fed
+  // every edge, so even a short press between two runs is seen, and is ticked at the end for
+  // its double click and long press timeouts.
+  remoteUpdate();
+  byte event;
+  while (inputPop(&event)) {
+    switch (event & EVENT_TYPE) {
+      case EVENT_CW:
+        encoderStep(DIR_CW, EVENT_ACCEL(event));
+        break;
+      case EVENT_CCW:
+        encoderStep(DIR_CCW, EVENT_ACCEL(event));
+        break;
+      default:
+        button.tick((event & EVENT_TYPE) == EVENT_PRESS);
+        break;
+    }
+    // The screen saver task wakes the display and restarts its countdown.
+    user_activity = true;
+  }
+  button.tick();
+}
+
+void normalScreen(void) {
+  display.setTextSize(2);
+  if ((effect < 0) or (effect >= NR_OF_EFFECTS)) {
+    #ifdef DEBUG       
+      Serial.println(F("Unknown effect value"));
+    #endif
+    effect = NR_OF_EFFECTS - 1;
+  }
+  byte flags = EFFECT_BYTE(effect, flags);
+
+  // If in settings mode, show the parameter's name and value (if applicable).
+  if ((select_mode == false) and (screen_saver == OFF) and (param_page == PAGE_DEPTH)) {
+    displayText(FSTR(depth_label), 0, 0, 0, CLEAR_LINE, 2);
+    textAppend(textNumber(text_buffer, effect_state[effect].depth), F("%"));
+    displayText(text_buffer, 0, 0, COUNTER_POSITION + 1, CLEAR_LINE, 2);
+  } else if ((select_mode == false) and (screen_saver == OFF) and (param_page == PAGE_PATTERN)) {
+    displayText(FSTR(pattern_label), 0, 0, 0, CLEAR_LINE, 2);
+    displayText(FSTR(pgm_read_ptr(&pattern_names[pattern_number])), 0, 0, 6, CLEAR_LINE, 2);
+  } else if ((select_mode == false) and (screen_saver == OFF) and (param_page == PAGE_SHAPE)) {
+    displayText(FSTR(shape_label), 0, 0, 0, CLEAR_LINE, 2);
+    displayText(FSTR(pgm_read_ptr(&sweep_shape_names[sweep_shape])), 0, 0, 9, CLEAR_LINE, 2);
+  } else if ((select_mode == false) and (screen_saver == OFF) and (param_page == PAGE_CV)) {
+    displayText(FSTR(cv_label), 0, 0, 0, CLEAR_LINE, 2);
+    displayText(FSTR(pgm_read_ptr(&cv_names[effect_state[effect].cv_route])), 0, 0, 5, CLEAR_LINE, 2);
+  } else if (select_mode == false and screen_saver == OFF) {
+    displayText(FSTR(EFFECT_PTR(effect, label)), 0, 0, 0, CLEAR_LINE, 2);
+    byte base = EFFECT_BYTE(effect, value_base);
+    switch (EFFECT_BYTE(effect, value)) {
+      case VALUE_MS:
+        // Time between the echoes, or of the PT2399s in series.
+        textAppend(textNumber(text_buffer, base * delayTimeMs(BOARD1, effect_state[effect].counter * DUTY_PER_TIME_STEP)), F("ms"));
+        displayText(text_buffer, 0, 0, MS_POSITION, CLEAR_LINE, 2);
+        break;
+      case VALUE_REVERB_MS:
+        // The time of the longer of the two delays.
+        textAppend(textNumber(text_buffer, delayTimeMs(BOARD1, (unsigned int) (MAX_COUNTER - (effect_state[effect].counter >> 1)) << 8)), F("ms"));
+        displayText(text_buffer, 0, 0, MS_POSITION, CLEAR_LINE, 2);
+        break;
+      case VALUE_COUNTER:
+        textNumber(text_buffer, effect_state[effect].counter);
+        displayText(text_buffer, 0, 0, COUNTER_POSITION + 1, CLEAR_LINE, 2);
+        break;
+      default:
+        textNumber(text_buffer, base - effect_state[effect].counter);
+        displayText(text_buffer, 0, 0, COUNTER_POSITION + 1, CLEAR_LINE, 2);
+        break;
+    }
+  }
+
+  // The effects themselves are run by the control rate engine (see controlTick()).
+  // Here only the effect's name is shown and the settings are scheduled to be saved.
+  // loopb is set to 'true' to force a redraw of the name, e.g. after a mode change.
+  bool changed = (effect != old_effect) or (effect_state[effect].counter != shown_counter);
+  if (changed or (loopb == true)) {
+    loopb = false;
+    if (changed) {
+      updateEepromTimer();
+    }
+    if ((select_mode == true) and (screen_saver == OFF)) {
+      displayText(FSTR(EFFECT_PTR(effect, name)), MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
+    }
+    count_direction = (flags & FX_COUNT_LEFT) ? LEFT : RIGHT;
+    old_effect = effect;
+    shown_counter = effect_state[effect].counter;
+  } 
+
+  // Update wet/dry status in display only when it has changed.
+  const char *status = ((flags & FX_MIX) or ((flags & FX_DRY) and no_dry_signal)) ? WD : WT;
+  if (screen_saver == ON) {
+    shown_status = 0; // Show it again when the screen saver ends.
+  } else if ((old_no_dry_signal != no_dry_signal) or (status != shown_status)) {
+    old_no_dry_signal = no_dry_signal;
+    shown_status = status;
+    display.setTextSize(1);
+    displayText(FSTR(status), 4, 3, MAX_FX_NAME_LEN + 1, CLEAR_LOCAL, 1);
+    display.setTextSize(2);
+  }
+}
+
+void uiTask(void) {
+  // Draw the screen of the current mode and send what changed. A new mode starts on a clean
+  // screen and the normal screen is drawn completely again when it comes back.
+  byte mode = ui_mode;
+  bool entered = (mode != shown_mode);
+  if (entered) {
+    shown_mode = mode;
+    displayClear();
+    loopb = true;
+    old_no_dry_signal = !no_dry_signal;
+    shown_status = 0;
+  }
+  switch (mode) {
+    case MODE_DEBUG:
+      debugMode();
+      displayText(F("Mode: debug"), MAX_MODE_NAME_LEN, 0, 0, CLEAR_LOCAL);
+      break;
+    case MODE_BYPASS:
+      // Nothing changes while bypassed, so it is drawn once.
+      if (entered) {
+        display.setTextSize(1);
+        displayText(F("Mode: bypass"), MAX_MODE_NAME_LEN, 0, 0, CLEAR_LINE);
+      }
+      break;
+    case MODE_CALIBRATION:
+      calibrationMode();
+      break;
+    case MODE_SELFTEST:
+      selfTestMode();
+      break;
+    case MODE_MENU:
+      menuMode();
+      break;
+    case MODE_SPLASH:
+      // The splash screen is drawn step by step while the effect already runs.
+      splash_active = splashTick();
+      break;
+    default:
+      normalScreen();
+      if (warp_step != WARP_IDLE) {
+        warpTick();
+        displayFlush(WARP_PAGES_PER_FRAME);
+        return;
+      }
+      break;
+  }
+  displayFlush();
+}
+
+void persistTask(void) {
+  writeSettingsToEeprom();
+}
+
+// The tasks in order of priority. A budget is a guide line: an overrun is counted (and
+// reported in DEBUG builds), the task is not stopped.
+const Task tasks[NR_OF_TASKS] PROGMEM = {
+  {controlTask,     1,            200},   // TASK_CONTROL
+  {inputTask,       5,            300},   // TASK_INPUT
+  {uiTask,          UI_PERIOD_MS, 15000}, // TASK_UI, a full display update over I2C.
+  {screensaverTask, 50,           500},   // TASK_SCREENSAVER, a few SSD1306 commands at most.
+  {persistTask,     100,          500},   // TASK_PERSIST
+};
+
+void setupScheduler(void) {
+  unsigned long now = millis();
+  for (byte i = 0; i < NR_OF_TASKS; i++) {
+    task_next[i] = now;
+    task_overruns[i] = 0;
+  }
+  last_activity = now;
+}
+
+void runScheduler(void) {
+  unsigned long now = millis();
+  for (byte i = 0; i < NR_OF_TASKS; i++) {
+    if ((long) (now - task_next[i]) < 0) continue;
+    unsigned int period = pgm_read_word(&tasks[i].period);
+    task_next[i] += period;
+    if ((long) (now - task_next[i]) >= 0) {
+      // Late by more than a period: skip the missed runs in stead of catching up in a burst.
+      task_next[i] = now + period;
+    }
+    void (*run)(void) = (void (*)(void)) pgm_read_ptr(&tasks[i].run);
+    unsigned long start = micros();
+    run();
+    unsigned long took = micros() - start;
+    #ifdef PROFILE
+      profileRecord(PROF_TASK, took);
+    #endif
+    if (took > pgm_read_word(&tasks[i].budget)) {
+      if (task_overruns[i] < 255) task_overruns[i]++;
+      #ifdef DEBUG
+        Serial.print(F("Task "));
+        Serial.print(i);
+        Serial.print(F(" over budget: "));
+        Serial.println(took);
+      #endif
+    }
+    return;
   }
-  #ifdef DEBUG
-    Serial.print("Timer call -> Action: ");
-    Serial.print(action);
-    Serial.print(", Current Time: ");
-    Serial.println(millis());
-  #endif
 }
 
 void setup() {
-  // Set serial device, only for debug purposes
-  Serial.begin(115200);
-  setupDisplay();
+  #ifdef HAL_RP2040
+    // HAL: before anything takes the lock, reads the settings or starts the display.
+    critical_section_init(&hal_lock);
+    EEPROM.begin(E2END + 1);
+    Wire.setSDA(HAL_I2C_SDA);
+    Wire.setSCL(HAL_I2C_SCL);
+  #endif
+  // Set serial device, for the remote control and debug purposes.
+  #ifdef MIDI_REMOTE
+    Serial.begin(31250);
+  #else
+    Serial.begin(115200);
+  #endif
   // Set the pins  
   pinMode(DELAY1,   OUTPUT);
   pinMode(DELAY2,   OUTPUT);
@@ -645,419 +3736,57 @@ void setup() {
   pinMode(PEDAL_SWITCH,    INPUT_PULLUP);
   pinMode(DEBUG_JUMPER,  INPUT_PULLUP);
 
+  setupCvRouting();
+  #if defined(CV_INPUT) or defined(ENVELOPE_INPUT)
+    setupAdc();
+  #endif
+
   // Get settings from last time using Time-Warp-O-Matic.
   readSettingsFromEeprom();
+  readCalibrationFromEeprom();
 
-  // Initialize the PWM outputs for the current effect.
-  setDelays(counter[effect], counter[effect]);
-
-  // Set a few max values for the counters.
-  counter_max[DECELERATOR] = DECELERATOR_UPDATE_TIME_MAX;
-  counter_max[WOW_NOT_FLUTTER] = WOW_NOT_FLUTTER_TIME_MAX;
-
-  // Initialize the CD4066 switches.
-  // Allow some signal to flow into the 2nd tap.
-  setSwitches(LOW, HIGH, LOW, LOW);
+  // Start the engine right away: its first control tick (1 ms from now) sets the routing and
+  // the PWM outputs of the saved effect, so the pedal works before the display is even set up.
+  #ifdef HIRES_PWM
+    setupHiResPwm();
+  #endif
+  setupControlTimer();
+  setupDisplay();
   
   // Initialize ports for rotary encoder
   pinMode(pinA, INPUT_PULLUP); // Set pinA as an input, pulled HIGH to the logic voltage (5V or 3.3V for most cases)
   pinMode(pinB, INPUT_PULLUP); // Set pinB as an input, pulled HIGH to the logic voltage (5V or 3.3V for most cases)
 
   // Set hardware interrupts for rotary encoder.
-  attachInterrupt(0, rotate, CHANGE);
-  attachInterrupt(1, rotate, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(pinB), rotate, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(pinA), rotate, CHANGE);
 
   // Attach methods to button clicks.
   button = OneButton(ENC_PUSH, true);
   button.attachClick(encoderClick);
   button.attachDoubleClick(encoderDoubleClick);
+  button.attachLongPressStart(encoderLongPress);
   
-  // Attach interrupt service routine to ENC_PUSH and call button.tick in order to get
-  // a fast response for 'encoder click' and 'encoder double click' events.
-  PCICR |= (1 << PCIE1);    // This enables Pin Change Interrupt 1 that covers the Analog input pins or Port C.
-  PCMSK1 |= (1 << PCINT9);  // This enables the interrupt for pin 1 of Port C: This is A1.
+  // Attach interrupt service routines to ENC_PUSH, PEDAL_SWITCH and BYPASS_DETECT.
+  bypass_pin = digitalRead(BYPASS_DETECT);
+  bypassed = (bypass_pin == LOW);
+  setupPinChangeInterrupts();
 
-  // Initialize old counter values.
-  for (int i = 0; i < NR_OF_EFFECTS; i++) {
-    old_counter[i] = counter[i];
-  }
+  shown_counter = effect_state[effect].counter;
 
-  #ifndef DEBUG  
-    // Show Splash screen but only when not in debug mode (to make debugging
+  #if defined(SPLASH_SCREEN) and !defined(DEBUG)
+    // Show Splash screen (from the UI task) but only when not in debug mode (to make debugging
     // less tedious).
-    showSplashScreen();
+    splash_active = true;
   #endif
 
-  // Initialize a timer for the screen saver.
-  stensTimer = StensTimer::getInstance();
-  // Tell StensTimer which callback function to use.
-  stensTimer->setStaticCallback(cls);
-  // Set a timer which calls cls after some time.
-  clsTimer = stensTimer->setTimer(CLS_TIMER_ACTION, SCREEN_TIMEOUT, 1);
-  // Set up a repeating timer which shows the time warp once in a while if the screensaver is on.
-  screensaverTimer = stensTimer->setTimer(SCREENSAVER_TIMER_ACTION, SCREENSAVER_TIMEOUT, SCREENSAVER_REPETITION);
-}
-
-float speed_factor(void) { 
-  // Return a float between 1.0 and 2.0
-  return random(100, 401) / 100.0; 
+  setupScheduler();
+  prng_state = (unsigned int) micros() | 1; // Any non zero seed, the boot time varies a little.
+  #ifdef PROFILE
+    profileReset();
+  #endif
 }
 
 void loop() {
-  static int delta = 1;
-  static float delta_speed = 1.0;
-  byte td = 0;
-  
-  // Detect if the effect is in DEBUG MODE.
-  while((digitalRead(DEBUG_JUMPER) == LOW)) {
-    debugMode();  
-    displayText("Mode: debug", MAX_MODE_NAME_LEN, 0, 0, CLEAR_LOCAL);
-  }  
-  
-  // Detect if the effect is on or off.
-  while((digitalRead(BYPASS_DETECT) == LOW)) {
-    // Going into bypass mode. To hear anything the W/D potentiometer should be turned to W.
-    setSwitches(LOW, LOW, HIGH, LOW);
-    display.setTextSize(1);
-    displayText("Mode: bypass", MAX_MODE_NAME_LEN, 0, 0, CLEAR_LINE);
-    effect_status = LOW;
-  } 
-
-  display.setTextSize(2);
-  effect_status = HIGH;
-  // If in settings mode, show the parameter's name and value (if applicable).
-  if (select_mode == false and screen_saver == OFF) {
-    switch(effect) {
-      case(CHORUS):
-      case(FAST_CHORUS):
-        displayText("Speed:", 0, 0, 0, CLEAR_LINE, 2);
-        displayText((String) (CHORUS_UPPER_LIMIT - counter[effect]), 0, 0, COUNTER_POSITION + 1, CLEAR_LINE, 2);
-        break;
-                 
-      case (WOW_NOT_FLUTTER):
-      case(DECELERATOR):      
-        displayText("Speed:", 0, 0, 0, CLEAR_LINE, 2);
-        displayText((String) (counter_max[effect] - counter[effect]), 0, 0, COUNTER_POSITION + 1, CLEAR_LINE, 2);
-        break;
-
-      case (REVERB):
-        displayText("Time:", 0, 0, 0, CLEAR_LINE, 2);
-        displayText((String) counter[effect], 0, 0, COUNTER_POSITION + 1, CLEAR_LINE, 2);
-        break;
-                
-      default:
-        displayText("Time:", 0, 0, 0, CLEAR_LINE, 2);
-        displayText((String) (MAX_COUNTER - counter[effect]), 0, 0, COUNTER_POSITION + 1, CLEAR_LINE, 2);
-        break;
-    }
-  }
-
-  // This is the main effect loop.
-  // loopb should be set to 'true' for an effect if:
-  // 1: the effect depends on the 'PEDAL_SWITCH' button
-  // 2: the effect uses its own counter 'counter[effect]'.
-
-  if (effect != old_effect) {
-    DECELERATOR_only_once = true;
-  }
-  
-  if ((effect != old_effect) || 
-      (counter[effect] != old_counter[effect]) ||
-      (loopb == true)) {
-    switch(effect)
-    {
-
-     case(FAST_CHORUS):
-       delta = 2;
-       if ((select_mode == true) and (screen_saver == OFF)) displayText("Chorus+", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       // fall through into case(CHORUS)
-       
-     case(CHORUS):
-       delta = 2;
-       if ((effect == CHORUS) and (select_mode == true) and (screen_saver == OFF)) displayText("Chorus", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = true;   
-       setSwitches(HIGH, LOW, !digitalRead(PEDAL_SWITCH), HIGH);       
-       if (effect != old_effect) {
-         updateEepromTimer();
-       }
-       if (direction_up == 1) {
-         if (chorus_counter > CHORUS_UPPER_LIMIT) {
-             chorus_counter = CHORUS_UPPER_LIMIT; 
-             direction_up = 0;
-         }
-         // Delay created by millis();
-         delay_currentMillis = millis();
-         if ((delay_currentMillis - delay_previousMillis) > (MIN_TIME + (counter[CHORUS] >> 1))) {
-           delay_previousMillis = delay_currentMillis;
-           chorus_counter += delta; // If too fast try divider.
-         }           
-       } else { 
-           if (chorus_counter < CHORUS_LOWER_LIMIT) {
-             chorus_counter = CHORUS_LOWER_LIMIT;
-             direction_up = 1;
-           }
-           // Delay created by millis();
-           delay_currentMillis = millis();
-           if ((delay_currentMillis - delay_previousMillis) > (MIN_TIME + (counter[CHORUS] >> 1))) {
-             delay_previousMillis = delay_currentMillis;
-             chorus_counter -= delta; // If too fast try divider.
-           }
-       }
-       setDelays(chorus_counter, 440 - chorus_counter);
-       count_direction = RIGHT;
-     break; 
-
-     case(DECELERATOR): 
-       if ((select_mode == true) and (screen_saver == OFF)) {
-        displayText("Deceleratr", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       }
-       count_direction = RIGHT;
-       loopb = true;
-       if (effect != old_effect) {
-         updateEepromTimer();
-         setSwitches(LOW, LOW, LOW, LOW);
-       }
-       if (digitalRead(PEDAL_SWITCH) == HIGH) {
-         DECELERATOR_only_once = true;
-       }
-       if (DECELERATOR_only_once == true) {
-         if (digitalRead(PEDAL_SWITCH) == LOW) {
-           setSwitches(LOW, HIGH, LOW, LOW);
-           DECELERATOR_only_once = false;
-         } else {
-           setSwitches(LOW, LOW, LOW, LOW);   
-         }
-         DECELERATOR_counter = DECELERATOR_counter_max;
-       }
-       if (counter[DECELERATOR] > DECELERATOR_UPDATE_TIME_MAX) counter[DECELERATOR] = DECELERATOR_UPDATE_TIME_MAX;
-       if (counter[DECELERATOR] < DECELERATOR_UPDATE_TIME_MIN) counter[DECELERATOR] = DECELERATOR_UPDATE_TIME_MIN;
-       // If TAP footswitch is pushed, reduce the delay time (DECELERATOR_counter) c.q. "slow down" the signal.
-       if ((digitalRead(PEDAL_SWITCH) == LOW) && (DECELERATOR_counter >= DECELERATOR_counter_min)) {  
-         // The lines below introduce a delay, so the delay time (DECELERATOR_counter) is not reduced too fast.  
-         delay_currentMillis = millis();
-         if ((delay_currentMillis - delay_previousMillis) >= counter[DECELERATOR]) {
-           delay_previousMillis = delay_currentMillis;
-           DECELERATOR_counter--;
-         }
-         if ((DECELERATOR_counter == DECELERATOR_counter_min) and (digitalRead(PEDAL_SWITCH) == LOW)) {
-           setSwitches(LOW, LOW, LOW, LOW);
-         }
-       }
-
-       // Update the delay time.
-       setDelays(DECELERATOR_counter, DECELERATOR_counter);
-     break; 
-  
-     case(SHORT_DELAY1):
-       if (select_mode == true) displayText("Short dly", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = false;
-       setSwitches(HIGH, LOW, no_dry_signal, LOW);
-       setDelays(counter[SHORT_DELAY1], counter[SHORT_DELAY1]);
-       updateEepromTimer();
-       count_direction = RIGHT;
-     break; 
-
-     #ifdef DEBUG
-       // This delay should be the same as SHORT_DELAY1. If it is not, then
-       // something is wrong with the 2nd PT2399 board or its PWM signal.
-       // This case is only usable for debugging the hardware.
-       case(SHORT_DELAY2):
-         if (select_mode == true) displayText("Short dly2", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-         loopb = false;
-         setSwitches(LOW, LOW, no_dry_signal, HIGH);
-         setDelays(counter[SHORT_DELAY2], counter[SHORT_DELAY2]);
-         updateEepromTimer();
-         count_direction = RIGHT;
-       break; 
-     #endif
-
-     case(DELAY):
-       if (select_mode == true) displayText("Delay", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = false;
-       // Do not include the tap 1 signal directly in the output.
-       setSwitches(LOW, HIGH, no_dry_signal, LOW);
-       setDelays(counter[DELAY], counter[DELAY]);
-       updateEepromTimer();
-       count_direction = RIGHT;
-     break; 
-  
-     case(ECHO1):
-       if (select_mode == true) displayText("Echo", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = false;
-       // Feed forward the dry signal to the 2nd tap.
-       setSwitches(LOW, HIGH, no_dry_signal, HIGH);
-       setDelays(counter[ECHO1], counter[ECHO1]);
-       updateEepromTimer();
-       count_direction = RIGHT;
-     break; 
-
-     case(ECHO2):
-       if (select_mode == true) displayText("Echo+", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = false;
-       // Do not feed forward the dry signal to the 2nd tap.
-       setSwitches(HIGH, HIGH, no_dry_signal, LOW);
-       setDelays(counter[ECHO2], counter[ECHO2]);
-       updateEepromTimer();
-       count_direction = RIGHT;
-     break;        
-
-     case(ECHO3):
-       if (select_mode == true) displayText("Echo++", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = false;
-       // Include the 'middle tap' signal directly in the output as well.
-       setSwitches(HIGH, HIGH, no_dry_signal, HIGH);
-       setDelays(counter[ECHO3], counter[ECHO3]);
-       updateEepromTimer();
-       count_direction = RIGHT;
-     break; 
-         
-     case(REVERB):
-       if (select_mode == true) displayText("Reverb", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = false;
-       setSwitches(HIGH, LOW, no_dry_signal, HIGH);
-       setDelays(MAX_COUNTER, MAX_COUNTER - (counter[REVERB] >> 1)); // One delay is 1/2 the other.
-       updateEepromTimer();
-       count_direction = LEFT;
-       break; 
-  
-     case(TELEGRAPH): 
-       if ((select_mode == true) and (screen_saver == OFF)) displayText("Telegraph", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = true;     
-       //setSwitches(LOW, LOW, !digitalRead(PEDAL_SWITCH), LOW); // original
-       setSwitches(!digitalRead(PEDAL_SWITCH), LOW, HIGH, LOW);
-       if (effect != old_effect) {
-         updateEepromTimer();
-       }    
-       count_direction = LEFT;
-     break; 
-
-     case(TELEVERB): // switch reverbed signal on using the tap key.
-       if ((select_mode == true) and (screen_saver == OFF)) displayText("TeleVerb", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = true;
-       td = !digitalRead(PEDAL_SWITCH);       
-       setSwitches(td, LOW, td, td);
-       setDelays(220, 220 - (counter[REVERB] >> 1));       
-       if (effect != old_effect) {
-         updateEepromTimer();
-       }    
-       count_direction = LEFT;
-     break; 
-
-     case(WOW_NOT_FLUTTER): 
-       if ((select_mode == true) and (screen_saver == OFF)) displayText("WowNotFlut", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = true;  
-       if (effect != old_effect) {
-         updateEepromTimer();
-         setSwitches(HIGH, LOW, LOW, LOW);
-         delta = random(1, 11);
-         delta_speed = random(100, 401) / 100.0; 
-         WOW_NOT_FLUTTER_counter = WOW_NOT_FLUTTER_counter_min;
-       }
-       // counter[WOW_NOT_FLUTTER] determines the speed of changing the delay time.
-       // WOW_NOT_FLUTTER_DELTA determines the step size of the change in delay time.
-       delay_currentMillis = millis();
-       if (delay_currentMillis - delay_previousMillis >= delta_speed * counter[WOW_NOT_FLUTTER]) {
-         delay_previousMillis = delay_currentMillis;
-         WOW_NOT_FLUTTER_counter += delta;
-         if (WOW_NOT_FLUTTER_counter < WOW_NOT_FLUTTER_counter_min) {
-           // Choose a positive value for delta.
-           delta = random(0, 5);
-           delta_speed = (counter[WOW_NOT_FLUTTER] / WOW_NOT_FLUTTER_counter_max) * random(100, 401) / 100.0; 
-         } else {
-           if (WOW_NOT_FLUTTER_counter > WOW_NOT_FLUTTER_counter_max) {
-             // Choose a negative value for delta.
-             delta = -random(0, 5);    
-             delta_speed = (counter[WOW_NOT_FLUTTER] / WOW_NOT_FLUTTER_counter_max) * random(100, 401) / 100.0; 
-           }
-         }
-       }
-       // Update the delay time.
-       setDelays(WOW_NOT_FLUTTER_counter * 2, WOW_NOT_FLUTTER_counter * 2);
-       count_direction = LEFT;
-     break;
-  
-     case(PSYCHO): 
-       if ((select_mode == true) and (screen_saver == OFF)) displayText("Psycho", MAX_FX_NAME_LEN, 0, 0, CLEAR_LINE);
-       loopb = true;
-       setSwitches(HIGH, HIGH, no_dry_signal, HIGH);       
-       if (effect != old_effect) {
-         updateEepromTimer();
-       }
-       if (direction_up == 1) {
-         psycho_counter++; // If too fast try divider. 
-         if (psycho_counter > 220) {
-           psycho_counter = 220; 
-           direction_up = 0;
-         }
-         delay(counter[PSYCHO] >> 1);
-       } else {
-           psycho_counter--; // If too fast try divider.
-           if (psycho_counter < 50) {
-             psycho_counter = 20;
-             direction_up = 1;
-           }
-           delay(counter[PSYCHO] >> 1);
-       }            
-       if ((psycho_counter >> 1) > 50)
-         analogWrite(DELAY1, psycho_counter >> 1); 
-       else 
-         analogWrite(DELAY1, 50);
-       analogWrite(DELAY2, 270 - psycho_counter);
-       count_direction = LEFT;
-     break; 
-         
-     default:
-       #ifdef DEBUG       
-         Serial.println("Unknown effect value");
-       #endif
-       effect = NR_OF_EFFECTS;
-       break;
-    }
-    old_effect = effect;
-    old_counter[effect] = counter[effect];
-  } 
-
-  // Update wet/dry status in display only when it has changed.
-  if ((old_no_dry_signal != no_dry_signal) or (digitalRead(PEDAL_SWITCH) == HIGH)) {
-    display.setTextSize(1);
-    old_no_dry_signal = no_dry_signal;
-    if (screen_saver == OFF) { // Only show the status when the screen saver is off.
-      switch(effect) {
-        case SHORT_DELAY1:
-        #ifdef DEBUG
-          case SHORT_DELAY2:
-        #endif
-        case DELAY:
-        case ECHO1:
-        case ECHO2:
-        case ECHO3:
-        case REVERB:
-        case PSYCHO:
-          if (no_dry_signal == false) // Only wet signal on output.
-            displayText((String) WT, 4, 3, MAX_FX_NAME_LEN + 1, CLEAR_LOCAL, 1);
-          else // Wet and dry signal on output.
-            displayText((String) WD, 4, 3, MAX_FX_NAME_LEN + 1, CLEAR_LOCAL, 1);
-          break;
-        case TELEVERB:
-          if (digitalRead(PEDAL_SWITCH) == HIGH) {
-            displayText((String) WD, 4, 3, MAX_FX_NAME_LEN + 1, CLEAR_LOCAL, 1);
-          }
-          break;
-        case DECELERATOR:
-        case CHORUS:
-        case FAST_CHORUS: // Wet only.
-        case WOW_NOT_FLUTTER:
-        case TELEGRAPH:        
-          displayText((String) WT, 4, 3, MAX_FX_NAME_LEN + 1, CLEAR_LOCAL, 1);
-        break;
-        default:
-          Serial.print("2: Unknown effect value: ");
-          Serial.println(effect);
-      }
-      display.setTextSize(2);
-    }
-  }
-  button.tick();
-  stensTimer->run();
-  writeSettingsToEeprom();
+  runScheduler();
 }